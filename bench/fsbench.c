@@ -0,0 +1,839 @@
+// Drives the peekfs handlers in-process, without the kernel or a mount.
+// It links the same objects as peekfs, apart from its main, so the
+// handlers in peek_oper are called exactly as libfuse would call them,
+// and a profile taken from it fits the peekfs build. The reply functions
+// they use are defined here instead, and hand the result back to the
+// benchmark rather than writing it to /dev/fuse.
+
+#define FUSE_USE_VERSION 26
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _XOPEN_SOURCE 700
+
+#include <fuse_lowlevel.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <db.h>
+#include <cache.h>
+#include <roms.h>
+#include <node.h>
+#include <mount.h>
+#include <stats.h>
+#include <peek.h>
+
+#define BUFFER_SIZE 4096
+#define BENCH_CORE "BENCH"
+#define BENCH_CHUNK (128 * 1024)
+#define BENCH_DIRENTS 4096
+#define BENCH_NAME 64
+#define DEFAULT_FILES 10000
+#define DEFAULT_FACETS 24
+#define DEFAULT_VALUES 16
+#define DEFAULT_SIZE (256 * 1024)
+#define DEFAULT_ITERATIONS 2000
+#define DEFAULT_MAPSIZE 4096
+
+struct fuse_req
+{
+    struct Mount *mount;
+    int err;
+    struct fuse_entry_param entry;
+    struct stat attr;
+    off_t nextoff;
+    char *buf;
+    size_t len;
+};
+
+enum benchop
+{
+    BENCH_LOOKUP,
+    BENCH_GETATTR,
+    BENCH_OPENDIR,
+    BENCH_READDIR,
+    BENCH_OPEN,
+    BENCH_READ,
+    BENCH_OPS
+};
+
+static const char *__benchnames[BENCH_OPS] = {
+    "lookup",
+    "getattr",
+    "opendir",
+    "readdir",
+    "open",
+    "read"
+};
+
+// Every call is kept, so tails are exact rather than bucketed
+struct Samples
+{
+    uint64_t *items;
+    size_t count;
+    size_t size;
+    uint64_t total;
+};
+
+struct Bench
+{
+    char *dir;
+    char *srcpath;
+    char *tsvpath;
+    int files;
+    int facets;
+    int values;
+    off_t size;
+    int iterations;
+    int cold;
+    unsigned int seed;
+    struct Mount *mount;
+    char readbuf[BENCH_CHUNK];
+    struct Samples samples[BENCH_OPS];
+};
+
+static const char *__benchwords[] = {
+    "Alpha", "Blaster", "Castle", "Dragon", "Echo", "Fighter", "Galaxy", "Hyper", "Island",
+    "Jungle", "Knight", "Legend", "Mario", "Ninja", "Orbit", "Pinball", "Quest", "Racer",
+    "Soccer", "Tetris", "Ultra", "Vortex", "Wizard", "Xevious", "Yoshi", "Zelda", "1942"
+};
+
+static const char *__benchregions[] = { "USA", "Europe", "Japan", "World" };
+
+// Folders as peekfs names them
+static const char *__alphapath = "A-Z";
+static const char *__searchpath = "Search";
+static const char *__refinepath = "~ Refine";
+
+void *fuse_req_userdata(fuse_req_t req)
+{
+    return req->mount;
+}
+
+int fuse_reply_err(fuse_req_t req, int err)
+{
+    req->err = err;
+    return 0;
+}
+
+void fuse_reply_none(fuse_req_t req)
+{
+    req->err = 0;
+}
+
+int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e)
+{
+    req->err = 0;
+    req->entry = *e;
+    return 0;
+}
+
+int fuse_reply_attr(fuse_req_t req, const struct stat *attr, double attr_timeout)
+{
+    (void) attr_timeout;
+
+    req->err = 0;
+    req->attr = *attr;
+    return 0;
+}
+
+int fuse_reply_readlink(fuse_req_t req, const char *link)
+{
+    (void) link;
+
+    req->err = 0;
+    return 0;
+}
+
+int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi)
+{
+    (void) fi;
+
+    req->err = 0;
+    return 0;
+}
+
+int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size)
+{
+    (void) buf;
+
+    req->err = 0;
+    req->len = size;
+    return 0;
+}
+
+int fuse_reply_xattr(fuse_req_t req, size_t count)
+{
+    req->err = 0;
+    req->len = count;
+    return 0;
+}
+
+int fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags)
+{
+    (void) flags;
+
+    // Without a device to splice to, the pages are copied out instead,
+    // which is what libfuse falls back to when splicing isn't possible
+    struct fuse_buf *src = &bufv->buf[0];
+    size_t size = src->size < BENCH_CHUNK ? src->size : BENCH_CHUNK;
+
+    ssize_t len = pread(src->fd, req->buf, size, src->pos);
+    if (len < 0)
+    {
+        req->err = errno;
+        return -errno;
+    }
+
+    req->err = 0;
+    req->len = len;
+    return 0;
+}
+
+size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize, const char *name, const struct stat *stbuf, off_t off)
+{
+    (void) stbuf;
+
+    // Sized like a struct fuse_dirent, so a reply holds as many entries
+    size_t namelen = strlen(name);
+    size_t entlen = (24 + namelen + 7) & ~(size_t)7;
+
+    if (entlen <= bufsize)
+    {
+        memcpy(buf + 24, name, namelen);
+        req->nextoff = off;
+    }
+
+    return entlen;
+}
+
+static void benchsample(struct Samples *samples, uint64_t elapsed)
+{
+    if (samples->count == samples->size)
+    {
+        size_t size = samples->size ? samples->size * 2 : 4096;
+        uint64_t *items = realloc(samples->items, size * sizeof(uint64_t));
+        if (!items)
+            return;
+
+        samples->items = items;
+        samples->size = size;
+    }
+
+    samples->items[samples->count++] = elapsed;
+    samples->total += elapsed;
+}
+
+static void benchreq(struct Bench *bench, struct fuse_req *req)
+{
+    memset(req, 0, sizeof(struct fuse_req));
+    req->mount = bench->mount;
+    req->buf = bench->readbuf;
+}
+
+static int benchlookup(struct Bench *bench, fuse_ino_t parent, const char *name, fuse_ino_t *ino)
+{
+    struct fuse_req req;
+    benchreq(bench, &req);
+
+    uint64_t start = statsnow();
+    peek_oper.lookup(&req, parent, name);
+    benchsample(&bench->samples[BENCH_LOOKUP], statsnow() - start);
+
+    if (req.err)
+        return -1;
+
+    *ino = req.entry.ino;
+
+    return 0;
+}
+
+static int benchresolve(struct Bench *bench, const char *path, fuse_ino_t *ino)
+{
+    char buf[BUFFER_SIZE];
+    snprintf(buf, BUFFER_SIZE, "%s", path);
+
+    *ino = FUSE_ROOT_ID;
+
+    char *r = NULL;
+    char *part;
+    for (part = strtok_r(buf, "/", &r); part; part = strtok_r(NULL, "/", &r))
+    {
+        if (benchlookup(bench, *ino, part, ino))
+        {
+            printf("Failed to look up %s in %s\n", part, path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int benchgetattr(struct Bench *bench, fuse_ino_t ino)
+{
+    struct fuse_req req;
+    benchreq(bench, &req);
+
+    uint64_t start = statsnow();
+    peek_oper.getattr(&req, ino, NULL);
+    benchsample(&bench->samples[BENCH_GETATTR], statsnow() - start);
+
+    return req.err ? -1 : 0;
+}
+
+static int benchlist(struct Bench *bench, fuse_ino_t ino, int *entries)
+{
+    struct fuse_req req;
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+
+    // Forces every listing to be built again, like the first visit after
+    // the data changed
+    if (bench->cold)
+    {
+        cacheclose(&bench->mount->cache);
+        cacheinit(&bench->mount->cache);
+    }
+
+    benchreq(bench, &req);
+
+    uint64_t start = statsnow();
+    peek_oper.opendir(&req, ino, &fi);
+    benchsample(&bench->samples[BENCH_OPENDIR], statsnow() - start);
+
+    if (req.err)
+        return -1;
+
+    // The kernel reads a listing in pages, carrying on from the offset
+    // of the last entry it got
+    *entries = 0;
+    off_t offset = 0;
+    while (1)
+    {
+        benchreq(bench, &req);
+        req.nextoff = offset;
+
+        start = statsnow();
+        peek_oper.readdir(&req, ino, BENCH_DIRENTS, offset, &fi);
+        benchsample(&bench->samples[BENCH_READDIR], statsnow() - start);
+
+        if (req.err || req.len == 0)
+            break;
+
+        *entries += req.nextoff - offset;
+        offset = req.nextoff;
+    }
+
+    benchreq(bench, &req);
+    peek_oper.releasedir(&req, ino, &fi);
+
+    return 0;
+}
+
+static int benchread(struct Bench *bench, fuse_ino_t ino)
+{
+    struct fuse_req req;
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+
+    benchreq(bench, &req);
+
+    uint64_t start = statsnow();
+    peek_oper.open(&req, ino, &fi);
+    benchsample(&bench->samples[BENCH_OPEN], statsnow() - start);
+
+    if (req.err)
+        return -1;
+
+    off_t offset = 0;
+    while (1)
+    {
+        benchreq(bench, &req);
+
+        start = statsnow();
+        peek_oper.read(&req, ino, BENCH_CHUNK, offset, &fi);
+        benchsample(&bench->samples[BENCH_READ], statsnow() - start);
+
+        if (req.err || req.len == 0)
+            break;
+
+        offset += req.len;
+    }
+
+    benchreq(bench, &req);
+    peek_oper.release(&req, ino, &fi);
+
+    return 0;
+}
+
+static void benchname(int index, char *buf, size_t size)
+{
+    // Spread over every first letter and a few digits, with enough words
+    // in common that searches find many files
+    int words = sizeof(__benchwords) / sizeof(__benchwords[0]);
+    unsigned int hash = (unsigned int)index * 2654435761u;
+
+    snprintf(buf, size, "%s %s %05d (%s).nes",
+        __benchwords[index % words],
+        __benchwords[(hash >> 8) % words],
+        index,
+        __benchregions[(hash >> 16) % 4]);
+}
+
+static int benchgenerate(struct Bench *bench)
+{
+    printf("Generating %d files with %d facets of %d values...\n", bench->files, bench->facets, bench->values);
+
+    char name[BENCH_NAME];
+    char path[BUFFER_SIZE];
+    char key[BUFFER_SIZE];
+    struct Database *db = peekdb();
+
+    int i;
+    for (i = 0; i < bench->files; i++)
+    {
+        benchname(i, name, BENCH_NAME);
+        if (snprintf(path, BUFFER_SIZE, "%s/%s", bench->srcpath, name) >= BUFFER_SIZE)
+        {
+            printf("Path too long: %s\n", bench->srcpath);
+            return -1;
+        }
+
+        // Sparse, so a large collection costs no disk space
+        int fd;
+        if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(fd, bench->size))
+        {
+            printf("Failed to create %s: %s\n", path, strerror(errno));
+            if (fd >= 0)
+                close(fd);
+
+            return -1;
+        }
+
+        close(fd);
+    }
+
+    // The same data can also be written in the import format, so the
+    // peek command has something realistic to train on
+    FILE *tsv = NULL;
+    if (bench->tsvpath)
+    {
+        if ((tsv = fopen(bench->tsvpath, "w")) == NULL)
+        {
+            printf("Failed to create %s: %s\n", bench->tsvpath, strerror(errno));
+            return -1;
+        }
+
+        fprintf(tsv, "ROM");
+        int facet;
+        for (facet = 0; facet < bench->facets; facet++)
+            fprintf(tsv, "\tFacet%02d", facet);
+
+        fprintf(tsv, "\n");
+    }
+
+    // Written in batches, so no single transaction grows too large
+    for (i = 0; i < bench->files; i++)
+    {
+        if (i % 1000 == 0 && dbtxnopen(db, 0))
+        {
+            if (tsv)
+                fclose(tsv);
+
+            return -1;
+        }
+
+        benchname(i, name, BENCH_NAME);
+
+        if (tsv)
+            fprintf(tsv, "%s", name);
+
+        int res = 0;
+        if (i % 20 == 0)
+        {
+            snprintf(key, BUFFER_SIZE, "fav/%s", BENCH_CORE);
+            res |= dbput(db, key, name);
+        }
+
+        unsigned int hash = (unsigned int)i * 2246822519u;
+        int facet;
+        for (facet = 0; facet < bench->facets; facet++)
+        {
+            hash = hash * 1103515245u + 12345u;
+            snprintf(key, BUFFER_SIZE, "has/%s/Facet%02d/Value%02u", BENCH_CORE, facet, (hash >> 16) % bench->values);
+            res |= dbput(db, key, name);
+
+            if (tsv)
+                fprintf(tsv, "\tValue%02u", (hash >> 16) % bench->values);
+
+            // Some facets hold two values, like a game with two genres
+            if (facet % 4 == 0)
+            {
+                snprintf(key, BUFFER_SIZE, "has/%s/Facet%02d/Value%02u", BENCH_CORE, facet, (hash >> 8) % bench->values);
+                res |= dbput(db, key, name);
+
+                if (tsv)
+                    fprintf(tsv, "|Value%02u", (hash >> 8) % bench->values);
+            }
+        }
+
+        if (tsv)
+            fprintf(tsv, "\n");
+
+        if ((i % 1000 == 999 || i == bench->files - 1) && dbtxnclose(db))
+            res = -1;
+
+        if (res)
+        {
+            printf("Failed to store data for %s\n", name);
+            if (tsv)
+                fclose(tsv);
+
+            return -1;
+        }
+    }
+
+    if (tsv)
+        fclose(tsv);
+
+    return 0;
+}
+
+static int benchremove(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void) st;
+    (void) flag;
+    (void) ftw;
+
+    return remove(path);
+}
+
+static int benchsetup(struct Bench *bench, size_t mapsize)
+{
+    char path[BUFFER_SIZE];
+
+    snprintf(path, BUFFER_SIZE, "%s/%s", bench->dir, BENCH_CORE);
+    if ((bench->srcpath = strdup(path)) == NULL || mkdir(bench->srcpath, 0755))
+    {
+        printf("Failed to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    snprintf(path, BUFFER_SIZE, "%s/data", bench->dir);
+    if (dbsetpath(path, mapsize) || peekinit())
+        return -1;
+
+    if (benchgenerate(bench))
+        return -1;
+
+    snprintf(path, BUFFER_SIZE, "%s/Peek", bench->srcpath);
+    if ((bench->mount = mountnew(path)) == NULL)
+        return -1;
+
+    return peekattach(bench->mount);
+}
+
+static void benchfiles(char *buf, size_t size, int index)
+{
+    char name[BENCH_NAME];
+    benchname(index, name, BENCH_NAME);
+
+    char letter = name[0];
+    if (letter >= 'a' && letter <= 'z')
+        letter -= 'a' - 'A';
+
+    if (letter >= 'A' && letter <= 'Z')
+        snprintf(buf, size, "%s/%c/%s", __alphapath, letter, name);
+    else
+        snprintf(buf, size, "%s/0-9/%s", __alphapath, name);
+}
+
+static int benchrun_getattr(struct Bench *bench)
+{
+    char path[BUFFER_SIZE];
+
+    int i;
+    for (i = 0; i < bench->iterations; i++)
+    {
+        benchfiles(path, BUFFER_SIZE, rand_r(&bench->seed) % bench->files);
+
+        fuse_ino_t ino;
+        if (benchresolve(bench, path, &ino) || benchgetattr(bench, ino))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int benchrun_readdir(struct Bench *bench)
+{
+    char path[BUFFER_SIZE];
+
+    int i;
+    for (i = 0; i < bench->iterations; i++)
+    {
+        // A mix of the folders people open, from the menu root to facet
+        // values narrowed down by a refine folder
+        unsigned int pick = rand_r(&bench->seed);
+        int facet = pick % bench->facets;
+        int other = (facet + 1 + (pick >> 8) % (bench->facets - 1 ? bench->facets - 1 : 1)) % bench->facets;
+        int value = (pick >> 4) % bench->values;
+
+        switch (i % 6)
+        {
+            case 0:
+                snprintf(path, BUFFER_SIZE, "/");
+                break;
+
+            case 1:
+                snprintf(path, BUFFER_SIZE, "%s/%c", __alphapath, 'A' + (int)((pick >> 12) % 26));
+                break;
+
+            case 2:
+                snprintf(path, BUFFER_SIZE, "Facet%02d", facet);
+                break;
+
+            case 3:
+                snprintf(path, BUFFER_SIZE, "Facet%02d/Value%02d", facet, value);
+                break;
+
+            case 4:
+                snprintf(path, BUFFER_SIZE, "Facet%02d/Value%02d/%s/Facet%02d/Value%02d",
+                    facet, value, __refinepath, other, (int)((pick >> 16) % bench->values));
+                break;
+
+            case 5:
+                snprintf(path, BUFFER_SIZE, "%s/%s", __searchpath, __benchwords[(pick >> 12) % 26] + 1);
+                break;
+        }
+
+        fuse_ino_t ino;
+        int entries;
+        if (benchresolve(bench, path, &ino) || benchlist(bench, ino, &entries))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int benchrun_read(struct Bench *bench)
+{
+    char path[BUFFER_SIZE];
+
+    int i;
+    for (i = 0; i < bench->iterations; i++)
+    {
+        benchfiles(path, BUFFER_SIZE, rand_r(&bench->seed) % bench->files);
+
+        fuse_ino_t ino;
+        if (benchresolve(bench, path, &ino) || benchread(bench, ino))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int benchcmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double benchpercentile(struct Samples *samples, double percentile)
+{
+    size_t rank = (size_t)(samples->count * percentile);
+    if (rank >= samples->count)
+        rank = samples->count - 1;
+
+    return samples->items[rank] / 1000.0;
+}
+
+static void benchreport(struct Bench *bench)
+{
+    printf("\n%-9s %10s %12s %10s %10s %10s %10s\n", "op", "count", "ops/s", "p50", "p99", "p99.9", "max");
+
+    int op;
+    for (op = 0; op < BENCH_OPS; op++)
+    {
+        struct Samples *samples = &bench->samples[op];
+        if (samples->count == 0)
+            continue;
+
+        qsort(samples->items, samples->count, sizeof(uint64_t), benchcmp);
+
+        printf("%-9s %10zu %12.0f %10.1f %10.1f %10.1f %10.1f\n",
+            __benchnames[op],
+            samples->count,
+            samples->count / (samples->total / 1e9),
+            benchpercentile(samples, 0.50),
+            benchpercentile(samples, 0.99),
+            benchpercentile(samples, 0.999),
+            samples->items[samples->count - 1] / 1000.0);
+    }
+
+    // The same table as ~ Stats/latency, which breaks the handlers down
+    // into database, listing and syscall time
+    char text[BUFFER_SIZE];
+    if (peekstats(text, BUFFER_SIZE) > 0)
+        printf("\n%s", text);
+}
+
+static void usage(void)
+{
+    printf("Usage: fsbench [-c] [-k] [-d DIR] [-n FILES] [-f FACETS] [-v VALUES] [-b BYTES] [-i ITERATIONS] [-m MB] [-r SEED] [-t FILE]\n");
+    printf("  -c  rebuild every listing instead of using the listing cache\n");
+    printf("  -k  keep the generated folder and database\n");
+    printf("  -d  folder to generate into, which must not exist (default a new folder in /tmp)\n");
+    printf("  -n  number of files (default %d)\n", DEFAULT_FILES);
+    printf("  -f  number of facets (default %d)\n", DEFAULT_FACETS);
+    printf("  -v  values per facet (default %d)\n", DEFAULT_VALUES);
+    printf("  -b  size of each file (default %d)\n", DEFAULT_SIZE);
+    printf("  -i  iterations of each workload (default %d)\n", DEFAULT_ITERATIONS);
+    printf("  -m  database map size in MB (default %d)\n", DEFAULT_MAPSIZE);
+    printf("  -r  random seed (default 1)\n");
+    printf("  -t  also write the generated facets to FILE in the import format\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct Bench *bench;
+    if ((bench = calloc(1, sizeof(struct Bench))) == NULL)
+        return 1;
+
+    bench->files = DEFAULT_FILES;
+    bench->facets = DEFAULT_FACETS;
+    bench->values = DEFAULT_VALUES;
+    bench->size = DEFAULT_SIZE;
+    bench->iterations = DEFAULT_ITERATIONS;
+    bench->seed = 1;
+
+    size_t mapsize = DEFAULT_MAPSIZE;
+    int keep = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "ckd:n:f:v:b:i:m:r:t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                bench->cold = 1;
+                break;
+
+            case 'k':
+                keep = 1;
+                break;
+
+            case 'd':
+                bench->dir = strdup(optarg);
+                break;
+
+            case 'n':
+                bench->files = atoi(optarg);
+                break;
+
+            case 'f':
+                bench->facets = atoi(optarg);
+                break;
+
+            case 'v':
+                bench->values = atoi(optarg);
+                break;
+
+            case 'b':
+                bench->size = strtoll(optarg, NULL, 10);
+                break;
+
+            case 'i':
+                bench->iterations = atoi(optarg);
+                break;
+
+            case 'm':
+                mapsize = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'r':
+                bench->seed = strtoul(optarg, NULL, 10);
+                break;
+
+            case 't':
+                bench->tsvpath = optarg;
+                break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (bench->files <= 0 || bench->facets <= 0 || bench->values <= 0 || bench->iterations <= 0 || mapsize == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    if (bench->dir)
+    {
+        if (mkdir(bench->dir, 0755))
+        {
+            printf("Failed to create %s: %s\n", bench->dir, strerror(errno));
+            return 1;
+        }
+    }
+    else
+    {
+        char tmp[] = "/tmp/fsbench.XXXXXX";
+        if (mkdtemp(tmp) == NULL || (bench->dir = strdup(tmp)) == NULL)
+        {
+            printf("Failed to create a folder in /tmp\n");
+            return 1;
+        }
+    }
+
+    int res = benchsetup(bench, mapsize * 1048576);
+
+    const char *names[] = { "getattr", "readdir", "read" };
+    int (*runs[])(struct Bench *) = { benchrun_getattr, benchrun_readdir, benchrun_read };
+
+    int i;
+    for (i = 0; i < 3 && !res; i++)
+    {
+        printf("Running %s workload...\n", names[i]);
+
+        uint64_t start = statsnow();
+        res = runs[i](bench);
+        printf("%s: %.2fs\n", names[i], (statsnow() - start) / 1e9);
+    }
+
+    if (!res)
+        benchreport(bench);
+
+    if (bench->mount)
+        romsclose(&bench->mount->roms);
+
+    peekcleanup();
+
+    if (!keep)
+        nftw(bench->dir, benchremove, 16, FTW_DEPTH | FTW_PHYS);
+    else
+        printf("Kept %s\n", bench->dir);
+
+    for (i = 0; i < BENCH_OPS; i++)
+        free(bench->samples[i].items);
+
+    free(bench->srcpath);
+    free(bench->dir);
+    free(bench);
+
+    return res ? 1 : 0;
+}
\ No newline at end of file
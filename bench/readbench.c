@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+// Compares the two ways peekfs can answer a read. The copy path reads
+// into a buffer and writes it out again, like peek_read does through
+// libfuse. The splice path moves file pages into a pipe, like libfuse
+// does with the file descriptor buffers from peek_read_buf. Both feed a
+// pipe that is drained into /dev/null, standing in for /dev/fuse.
+
+#define DEFAULT_CHUNK (128 * 1024)
+#define DEFAULT_RUNS 3
+
+struct Sink
+{
+    int fd;
+    int devnull;
+};
+
+static void *sinkthread(void *arg)
+{
+    struct Sink *sink = (struct Sink *)arg;
+
+    ssize_t len;
+    while ((len = splice(sink->fd, NULL, sink->devnull, NULL, 1 << 20, SPLICE_F_MOVE)) != 0)
+    {
+        if (len < 0 && errno != EINTR)
+        {
+            printf("Error from sink splice: %s\n", strerror(errno));
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int writeall(int fd, char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t writelen = write(fd, buf, len);
+        if (writelen < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        buf += writelen;
+        len -= writelen;
+    }
+
+    return 0;
+}
+
+static int runcopy(int fd, int out, size_t chunk, off_t size)
+{
+    char *buf = malloc(chunk);
+    if (!buf)
+        return -1;
+
+    off_t offset = 0;
+    while (offset < size)
+    {
+        ssize_t readlen = pread(fd, buf, chunk, offset);
+        if (readlen <= 0)
+            break;
+
+        if (writeall(out, buf, readlen))
+        {
+            free(buf);
+            return -1;
+        }
+
+        offset += readlen;
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+static int runsplice(int fd, int out, size_t chunk, off_t size)
+{
+    loff_t offset = 0;
+    while (offset < size)
+    {
+        // Move exactly one chunk into the pipe, like one FUSE reply
+        ssize_t remaining = chunk;
+        while (remaining > 0)
+        {
+            ssize_t len = splice(fd, &offset, out, NULL, remaining, SPLICE_F_MOVE);
+            if (len < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                return -1;
+            }
+
+            if (len == 0)
+                return 0;
+
+            remaining -= len;
+        }
+    }
+
+    return 0;
+}
+
+static double runone(char *path, int usesplice, size_t chunk, int cold)
+{
+    int fd;
+    if ((fd = open(path, O_RDONLY)) < 0)
+    {
+        printf("Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (cold)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    int pipefd[2];
+    if (pipe(pipefd) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    // Give the pipe room for a whole chunk, like libfuse does
+    fcntl(pipefd[1], F_SETPIPE_SZ, chunk);
+
+    struct Sink sink;
+    sink.fd = pipefd[0];
+    if ((sink.devnull = open("/dev/null", O_WRONLY)) < 0)
+    {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        close(fd);
+        return -1;
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, sinkthread, &sink);
+
+    double start = now();
+    int res = usesplice
+        ? runsplice(fd, pipefd[1], chunk, st.st_size)
+        : runcopy(fd, pipefd[1], chunk, st.st_size);
+
+    close(pipefd[1]);
+    pthread_join(thread, NULL);
+    double elapsed = now() - start;
+
+    close(pipefd[0]);
+    close(sink.devnull);
+    close(fd);
+
+    if (res)
+    {
+        printf("Failed to read %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    return (st.st_size / 1048576.0) / elapsed;
+}
+
+static void usage(void)
+{
+    printf("Usage: readbench [-c] [-n RUNS] [-s CHUNK] FILE\n");
+    printf("  -c  drop FILE from the page cache before each run\n");
+    printf("  -n  number of runs per method (default %d)\n", DEFAULT_RUNS);
+    printf("  -s  bytes per read, like the FUSE max_read (default %d)\n", DEFAULT_CHUNK);
+}
+
+int main(int argc, char *argv[])
+{
+    int cold = 0;
+    int runs = DEFAULT_RUNS;
+    size_t chunk = DEFAULT_CHUNK;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "cn:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                cold = 1;
+                break;
+
+            case 'n':
+                runs = atoi(optarg);
+                break;
+
+            case 's':
+                chunk = strtoul(optarg, NULL, 10);
+                break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind >= argc || runs <= 0 || chunk == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    char *path = argv[optind];
+    const char *names[] = { "pread", "splice" };
+
+    int method;
+    for (method = 0; method < 2; method++)
+    {
+        double best = 0;
+        double total = 0;
+
+        int i;
+        for (i = 0; i < runs; i++)
+        {
+            double rate = runone(path, method, chunk, cold);
+            if (rate < 0)
+                return 1;
+
+            total += rate;
+            if (rate > best)
+                best = rate;
+        }
+
+        printf("%-8s avg %8.1f MB/s  best %8.1f MB/s\n", names[method], total / runs, best);
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+static unsigned int cachehash(const char *path)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (; *path; path++)
+    {
+        hash ^= (unsigned char)*path;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void listingfree(struct Listing *listing)
+{
+    free(listing->path);
+    free(listing->entries);
+    free(listing->names);
+    free(listing);
+}
+
+int cacheinit(struct Cache *cache)
+{
+    memset(cache, 0, sizeof(struct Cache));
+
+    if (pthread_mutex_init(&cache->lock, NULL))
+    {
+        printf("Failed to create cache lock\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void cacheclose(struct Cache *cache)
+{
+    int i;
+    for (i = 0; i < CACHE_SLOTS; i++)
+    {
+        if (cache->slots[i])
+        {
+            cacherelease(cache, cache->slots[i]);
+            cache->slots[i] = NULL;
+        }
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+}
+
+struct Listing *cacheget(struct Cache *cache, const char *path, size_t txnid, struct timespec *mtime)
+{
+    struct Listing *result = NULL;
+    unsigned int slot = cachehash(path) % CACHE_SLOTS;
+
+    pthread_mutex_lock(&cache->lock);
+
+    struct Listing *listing = cache->slots[slot];
+    if (listing && strcmp(listing->path, path) == 0)
+    {
+        // Only valid while neither the database nor the source folder
+        // have changed since the listing was built
+        if (listing->txnid == txnid
+            && listing->mtime.tv_sec == mtime->tv_sec
+            && listing->mtime.tv_nsec == mtime->tv_nsec)
+        {
+            listing->refs++;
+            result = listing;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return result;
+}
+
+struct Listing *cachepeek(struct Cache *cache, const char *path)
+{
+    struct Listing *result = NULL;
+    unsigned int slot = cachehash(path) % CACHE_SLOTS;
+
+    pthread_mutex_lock(&cache->lock);
+
+    // Stale or not, so a new listing can be compared against it
+    struct Listing *listing = cache->slots[slot];
+    if (listing && strcmp(listing->path, path) == 0)
+    {
+        listing->refs++;
+        result = listing;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return result;
+}
+
+void cacheput(struct Cache *cache, struct Listing *listing)
+{
+    unsigned int slot = cachehash(listing->path) % CACHE_SLOTS;
+    struct Listing *old;
+
+    pthread_mutex_lock(&cache->lock);
+
+    old = cache->slots[slot];
+    listing->refs++;
+    cache->slots[slot] = listing;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    if (old)
+        cacherelease(cache, old);
+}
+
+void cacherelease(struct Cache *cache, struct Listing *listing)
+{
+    int refs;
+
+    pthread_mutex_lock(&cache->lock);
+    refs = --listing->refs;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (refs == 0)
+        listingfree(listing);
+}
+
+struct Listing *listingnew(const char *path, size_t txnid, struct timespec *mtime)
+{
+    struct Listing *listing = calloc(1, sizeof(struct Listing));
+    if (!listing)
+        return NULL;
+
+    if ((listing->path = strdup(path)) == NULL)
+    {
+        free(listing);
+        return NULL;
+    }
+
+    listing->txnid = txnid;
+    listing->mtime = *mtime;
+    listing->refs = 1;
+
+    return listing;
+}
+
+int listingfill(void *buf, const char *name, const struct stat *st, off_t off)
+{
+    (void) off;
+
+    struct Listing *listing = (struct Listing *)buf;
+    size_t namelen = strlen(name) + 1;
+
+    if (listing->count == listing->size)
+    {
+        int size = listing->size ? listing->size * 2 : 64;
+        struct ListingEntry *entries = realloc(listing->entries, size * sizeof(struct ListingEntry));
+        if (!entries)
+            return 1;
+
+        listing->entries = entries;
+        listing->size = size;
+    }
+
+    if (listing->nameslen + namelen > listing->namessize)
+    {
+        size_t size = listing->namessize ? listing->namessize * 2 : 4096;
+        while (size < listing->nameslen + namelen)
+            size *= 2;
+
+        char *names = realloc(listing->names, size);
+        if (!names)
+            return 1;
+
+        listing->names = names;
+        listing->namessize = size;
+    }
+
+    struct ListingEntry *entry = &listing->entries[listing->count++];
+    entry->nameoff = listing->nameslen;
+    entry->ino = st ? st->st_ino : 0;
+    entry->mode = st ? st->st_mode : 0;
+
+    memcpy(listing->names + listing->nameslen, name, namelen);
+    listing->nameslen += namelen;
+
+    return 0;
+}
+
+char *listingname(struct Listing *listing, int index)
+{
+    return listing->names + listing->entries[index].nameoff;
+}
+
+int listingsame(struct Listing *a, struct Listing *b)
+{
+    if (a->count != b->count || a->nameslen != b->nameslen)
+        return 0;
+
+    if (a->nameslen && memcmp(a->names, b->names, a->nameslen) != 0)
+        return 0;
+
+    int i;
+    for (i = 0; i < a->count; i++)
+    {
+        if (a->entries[i].mode != b->entries[i].mode)
+            return 0;
+    }
+
+    return 1;
+}
\ No newline at end of file
@@ -0,0 +1,44 @@
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define CACHE_SLOTS 64
+
+struct ListingEntry
+{
+    size_t nameoff;
+    ino_t ino;
+    mode_t mode;
+};
+
+struct Listing
+{
+    char *path;
+    size_t txnid;
+    struct timespec mtime;
+    int refs;
+    struct ListingEntry *entries;
+    int count;
+    int size;
+    char *names;
+    size_t nameslen;
+    size_t namessize;
+};
+
+struct Cache
+{
+    pthread_mutex_t lock;
+    struct Listing *slots[CACHE_SLOTS];
+};
+
+int cacheinit(struct Cache *cache);
+void cacheclose(struct Cache *cache);
+struct Listing *cacheget(struct Cache *cache, const char *path, size_t txnid, struct timespec *mtime);
+struct Listing *cachepeek(struct Cache *cache, const char *path);
+void cacheput(struct Cache *cache, struct Listing *listing);
+void cacherelease(struct Cache *cache, struct Listing *listing);
+struct Listing *listingnew(const char *path, size_t txnid, struct timespec *mtime);
+int listingfill(void *buf, const char *name, const struct stat *st, off_t off);
+char *listingname(struct Listing *listing, int index);
+int listingsame(struct Listing *a, struct Listing *b);
\ No newline at end of file
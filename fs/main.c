@@ -1,10 +1,15 @@
 #define FUSE_USE_VERSION 26
 
+#ifdef HAVE_CONFIG_H
 #include <config.h>
+#endif
 
 #define _XOPEN_SOURCE 700
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,41 +21,77 @@
 #include <dirent.h>
 #include <sys/time.h>
 #include <sys/xattr.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <db.h>
 #include <path.h>
-
+#include <cache.h>
+#include <roms.h>
+#include <node.h>
+#include <mount.h>
+#include <queue.h>
+#include <stats.h>
+#include <prefetch.h>
+#include <peek.h>
+
+#define EVENT_SIZE ( sizeof (struct inotify_event) )
+#define EVENT_BUFFER_SIZE ( 64 * ( EVENT_SIZE + 256 ) )
 #define BUFFER_SIZE 4096
+#define SOCKET_PATH "/tmp/peekfs.sock"
+#define SOCKET_LOCK_PATH "/tmp/peekfs.sock.lock"
+// The kernel is told when anything changes, so it can hold on to
+// entries and attributes for a long time
+#define PEEK_TIMEOUT 86400.0
+#define PEEK_CONSTRAINTS (NODE_DEPTH / 2 + 1)
 
-enum peekcmd
-{
-    PEEKCMD_ROOT,
-    PEEKCMD_FAV,
-    PEEKCMD_REC,
-    PEEKCMD_ALPHA,
-    PEEKCMD_HAS,
-    PEEKCMD_MANAGE
-};
-
-struct PathInfo
-{
-    char *stack[20];
-    int stacklen;
-    enum peekcmd cmd;
-    int isfile;
-    char *filepath;
-};
+typedef int (*peek_fill_t)(void *buf, const char *name, const struct stat *st, off_t off);
 
 static const char *__favpath = "Favorites";
 static const char *__recpath = "Recently Played";
 static const char *__alphapath = "A-Z";
+static const char *__searchpath = "Search";
 static const char *__managepath = "~ Manage Data";
 static const char *__managefav = "Favorite";
 static const char *__manageyay = "Updated!";
+static const char *__refinepath = "~ Refine";
+static const char *__statspath = "~ Stats";
+static const char *__statslatency = "latency";
+
+struct Options
+{
+    int symlinks;
+    int counts;
+    int stop;
+    int unmount;
+};
+
+static struct fuse_opt peek_opts[] = {
+    { "symlinks", offsetof(struct Options, symlinks), 1 },
+    { "counts", offsetof(struct Options, counts), 1 },
+    { "--stop", offsetof(struct Options, stop), 1 },
+    { "--unmount", offsetof(struct Options, unmount), 1 },
+    FUSE_OPT_END
+};
 
+static struct Options _opts;
 static struct Database _db;
-static char *_mountpath;
-static char *_srcpath;
-static char *_corename;
+static pthread_key_t _dbkey;
+static struct Mount *_mounts[MOUNT_MAX];
+static struct fuse_args _args;
+static int _multithreaded;
+static volatile int _terminated;
+static pthread_mutex_t _mountslock = PTHREAD_MUTEX_INITIALIZER;
+static struct Queue _queue;
+static struct Stats _stats;
+static struct Prefetch _prefetch;
+// Syscalls made inside a read transaction are taken off its time, so the
+// db row only counts LMDB itself
+static __thread uint64_t _txnstart;
+static __thread uint64_t _txnsys;
 
 static char *trimcheck(char *s, int *c)
 {
@@ -68,16 +109,86 @@ static char *trimcheck(char *s, int *c)
     return s;
 }
 
-static void peek_parsepathrelease(struct PathInfo *info)
+static int peek_ischeckbox(struct PathInfo *parent, const char *value)
 {
-    int i;
-    for (i = info->stacklen - 1; i >= 0; i--)
+    if (parent->cmd != PEEKCMD_MANAGE)
+        return 0;
+
+    // Below a file are its favorite checkbox and its facets, and below
+    // every level of a facet are the checkboxes for its values
+    if (parent->stacklen < 2)
+        return 0;
+
+    if (parent->stacklen == 2)
+        return strcmp(value, __managefav) == 0;
+
+    int checked;
+    trimcheck(parent->stack[parent->stacklen - 1], &checked);
+    return checked == -1;
+}
+
+static void peek_dbfree(void *arg)
+{
+    struct Database *db = (struct Database *)arg;
+
+    dbreaderclose(db);
+    free(db);
+}
+
+static struct Database *peek_db(void)
+{
+    // FUSE may call handlers from several threads at once, so each
+    // thread gets its own transaction and cursor
+    struct Database *db;
+    if ((db = pthread_getspecific(_dbkey)))
+        return db;
+
+    if ((db = malloc(sizeof(struct Database))) == NULL)
     {
-        free(info->stack[i]);
+        printf("Failed to allocate database handle\n");
+        return NULL;
     }
 
-    if (info->filepath)
-        free(info->filepath);
+    dbclone(db, &_db);
+
+    if (pthread_setspecific(_dbkey, db))
+    {
+        printf("Failed to store database handle\n");
+        free(db);
+        return NULL;
+    }
+
+    return db;
+}
+
+static int peek_txnopen(struct Database *db)
+{
+    _txnstart = statsnow();
+    _txnsys = 0;
+
+    return dbtxnopen(db, 1);
+}
+
+static int peek_txnclose(struct Database *db)
+{
+    int res = dbtxnclose(db);
+    statsrecord(&_stats, STATS_DB, statsnow() - _txnstart - _txnsys);
+
+    return res;
+}
+
+static void peek_sysdone(enum statsop op, uint64_t start)
+{
+    _txnsys += statsadd(&_stats, op, start);
+}
+
+static DIR *peek_srcdir(struct Mount *mount)
+{
+    uint64_t start = statsnow();
+    DIR *dp = opendir(mount->srcpath);
+    peek_sysdone(STATS_DIROPEN, start);
+
+    return dp;
 }
 
 static int peek_isfile(struct PathInfo *info)
@@ -89,10 +200,14 @@ static int peek_isfile(struct PathInfo *info)
             return (info->stacklen == 2) ? 1 : 0;
         
         case PEEKCMD_ALPHA:
-        case PEEKCMD_HAS:
+        case PEEKCMD_SEARCH:
             return (info->stacklen == 3) ? 1 : 0;
 
+        case PEEKCMD_STATS:
+            return (info->stacklen == 2) ? 1 : 0;
+
         case PEEKCMD_ROOT:
+        case PEEKCMD_HAS:
         case PEEKCMD_MANAGE:
             break;
     }
@@ -100,75 +215,232 @@ static int peek_isfile(struct PathInfo *info)
     return 0;
 }
 
-static char *peek_filepath(struct PathInfo *info)
+static int peek_filepath(struct PathInfo *info, char *buf)
 {
-    char buf[BUFFER_SIZE];
-    sprintf(buf, "%s/%s", _srcpath, info->stack[info->stacklen - 1]);
+    int len = snprintf(buf, BUFFER_SIZE, "%s/%s", info->mount->srcpath, info->stack[info->stacklen - 1]);
+    if (len < 0 || len >= BUFFER_SIZE)
+        return -ENAMETOOLONG;
+
+    return 0;
+}
 
-    char *result = malloc(strlen(buf) + 1);
-    strcpy(result, buf);
+static int peek_hasseg(struct PathInfo *info, int stacklen)
+{
+    // The facet being browsed starts just past the last refine folder
+    int i;
+    for (i = stacklen; i > 0; i--)
+    {
+        if (strcmp(info->stack[i - 1], __refinepath) == 0)
+            break;
+    }
 
-    return result;
+    return i;
 }
 
-static int peek_parsepath(struct PathInfo *info, const char *path)
+static int peek_haskey(struct PathInfo *info, int from, int to, char *buf, size_t size)
 {
-    memset(info, 0, sizeof(struct PathInfo));
+    size_t len = snprintf(buf, size, "has/%s", info->mount->corename);
+
+    int i;
+    for (i = from; i < to && len < size; i++)
+        len += snprintf(buf + len, size - len, "/%s", info->stack[i]);
+
+    if (len >= size)
+        return -ENAMETOOLONG;
 
-    char pathdup[BUFFER_SIZE];
-    strcpy(pathdup, path);
+    return len;
+}
+
+static void peek_hasfind(struct Database *db, char *key, int keylen, int *exact, int *children)
+{
+    MDB_val dbkey = {keylen + 1, key};
+    MDB_val dbdata;
+    *exact = !mdb_get(db->txn, db->dbfid, &dbkey, &dbdata);
 
-    // Skip leading slash in path
-    char *pathbeg = pathdup;
-    if (*pathbeg == '/')
-        pathbeg++;
+    // A key with deeper facets has a slice of its own
+    *children = !mdb_get(db->txn, db->dbsli, &dbkey, &dbdata);
+}
 
-    char *r = NULL;
-    char *t;
-    char *tmp;
-    int pos = 0;
-    for (t = strtokplus(pathbeg, '/', &r); t != NULL; t = strtokplus(NULL, '/', &r))
+static int peek_hasclassify(struct PathInfo *info)
+{
+    struct Database *db;
+    if ((db = peek_db()) == NULL)
+        return -EIO;
+
+    // Facets can be any depth, so only the database knows whether a name
+    // is another level, or a file in the facet above it
+    int last = info->stacklen - 1;
+    int seg = peek_hasseg(info, last);
+    char *name = info->stack[last];
+    int refine = strcmp(name, __refinepath) == 0;
+
+    char key[BUFFER_SIZE];
+    int parentlen;
+    int childlen;
+
+    int res = -ENOENT;
+    if (!peek_txnopen(db))
     {
-        tmp = malloc(strlen(t) + 1);
-        strcpy(tmp, t);
-        
-        info->stack[pos++] = tmp;
+        int exact = 0;
+        int children = 0;
+
+        if (!refine && (childlen = peek_haskey(info, seg, info->stacklen, key, BUFFER_SIZE)) >= 0)
+            peek_hasfind(db, key, childlen, &exact, &children);
+
+        if (exact || children)
+        {
+            info->isfile = 0;
+            res = 0;
+        }
+        else if (seg < last && (parentlen = peek_haskey(info, seg, last, key, BUFFER_SIZE)) >= 0)
+        {
+            peek_hasfind(db, key, parentlen, &exact, &children);
+
+            // Refine folders and files only live in facets that have files
+            if (exact)
+            {
+                info->isfile = !refine;
+                res = 0;
+            }
+        }
+
+        peek_txnclose(db);
     }
-    info->stacklen = pos;
 
-    enum peekcmd cmd;
-    if (info->stacklen == 0)
+    return res;
+}
+
+static int peek_managelevel(struct PathInfo *info)
+{
+    struct Database *db;
+    if ((db = peek_db()) == NULL)
+        return 0;
+
+    // A value with deeper levels is also a plain folder next to its
+    // checkbox
+    char key[BUFFER_SIZE + 1];
+    int keylen;
+    int exact = 0;
+    int children = 0;
+    if (!peek_txnopen(db))
     {
-        cmd = PEEKCMD_ROOT;
+        if (!dbcuropen(db))
+        {
+            if ((keylen = peek_haskey(info, 2, info->stacklen, key, BUFFER_SIZE)) >= 0)
+                peek_hasfind(db, key, keylen, &exact, &children);
+
+            dbcurclose(db);
+        }
+
+        peek_txnclose(db);
     }
-    else
+
+    return children;
+}
+
+static int peek_counted(struct PathInfo *info)
+{
+    // Counts are for the whole facet, so they would be wrong anywhere
+    // the files are narrowed down by a refine folder
+    if (!_opts.counts || info->isfile)
+        return 0;
+
+    if (info->cmd != PEEKCMD_ROOT && info->cmd != PEEKCMD_HAS)
+        return 0;
+
+    return peek_hasseg(info, info->stacklen) == 0;
+}
+
+static const char *peek_uncount(struct PathInfo *parent, const char *name, char *buf, size_t size)
+{
+    if (!peek_counted(parent))
+        return name;
+
+    // Strip a trailing " (123)" the listing added
+    size_t len = strlen(name);
+    if (len < 5 || name[len - 1] != ')')
+        return name;
+
+    size_t i = len - 2;
+    while (i > 0 && name[i] >= '0' && name[i] <= '9')
+        i--;
+
+    if (i == len - 2 || i < 2 || name[i] != '(' || name[i - 1] != ' ' || i - 1 >= size)
+        return name;
+
+    memcpy(buf, name, i - 1);
+    buf[i - 1] = '\0';
+
+    return buf;
+}
+
+static int peek_childinfo(struct PathInfo *parent, const char *name, struct PathInfo *info)
+{
+    // Nothing in the mount is nested this deep, and nothing lives below
+    // a file
+    if (parent->isfile || parent->stacklen == NODE_DEPTH)
+        return -ENOENT;
+
+    // The child borrows the components of its parent until it is added
+    // to the node table
+    *info = *parent;
+    info->path = NULL;
+    info->stack[info->stacklen++] = (char *)name;
+
+    // Only the first component picks the command, everything below
+    // inherits it
+    if (info->stacklen == 1)
     {
-        char *first = info->stack[0];
-        if (strcmp(first, __favpath) == 0)
+        if (strcmp(name, __favpath) == 0)
+        {
+            info->cmd = PEEKCMD_FAV;
+        }
+        else if (strcmp(name, __recpath) == 0)
+        {
+            info->cmd = PEEKCMD_REC;
+        }
+        else if (strcmp(name, __alphapath) == 0)
         {
-            cmd = PEEKCMD_FAV;
+            info->cmd = PEEKCMD_ALPHA;
         }
-        else if (strcmp(first, __recpath) == 0)
+        else if (strcmp(name, __managepath) == 0)
         {
-            cmd = PEEKCMD_REC;
+            info->cmd = PEEKCMD_MANAGE;
         }
-        else if (strcmp(first, __alphapath) == 0)
+        else if (strcmp(name, __searchpath) == 0)
         {
-            cmd = PEEKCMD_ALPHA;
+            info->cmd = PEEKCMD_SEARCH;
         }
-        else if (strcmp(first, __managepath) == 0)
+        else if (strcmp(name, __statspath) == 0)
         {
-            cmd = PEEKCMD_MANAGE;
+            info->cmd = PEEKCMD_STATS;
         }
         else
         {
-            cmd = PEEKCMD_HAS;
+            info->cmd = PEEKCMD_HAS;
         }
     }
 
-    info->cmd = cmd;
-    if ((info->isfile = peek_isfile(info)))
-        info->filepath = peek_filepath(info);
+    if (info->cmd == PEEKCMD_HAS)
+        return peek_hasclassify(info);
+
+    // Any folder name below Search is a query, but only the files it
+    // matches live inside it
+    if (info->cmd == PEEKCMD_SEARCH && info->stacklen == 3 && !dbmatch(name, info->stack[1]))
+        return -ENOENT;
+
+    if (info->cmd == PEEKCMD_STATS && info->stacklen == 2 && strcmp(name, __statslatency) != 0)
+        return -ENOENT;
+
+    // Checkboxes always carry their state, which leaves the bare name
+    // free for mkdir
+    int checked;
+    char *value = trimcheck((char *)name, &checked);
+    if (checked == -1 && peek_ischeckbox(parent, value)
+        && (parent->stacklen == 2 || !peek_managelevel(info)))
+        return -ENOENT;
+
+    info->isfile = peek_isfile(info);
 
     return 0;
 }
@@ -179,40 +451,104 @@ static int peek_getattr_fakedir(struct PathInfo *info, struct stat *stbuf)
 
     memset(stbuf, 0, sizeof(struct stat));
     stbuf->st_mode = S_IFDIR | 0755;
-    stbuf->st_nlink = 1;
+    stbuf->st_nlink = 2;
 
     return 0;
 }
 
 static int peek_getattr_file(struct PathInfo *info, struct stat *stbuf)
 {
+    char *name = info->stack[info->stacklen - 1];
+    if (!romsstat(&info->mount->roms, name, stbuf))
+        return 0;
+
+    // Follows links like the listings do, so both agree on what is cached
+    char filepath[BUFFER_SIZE];
     int res;
-	if ((res = lstat(info->filepath, stbuf)) == -1)
+    if ((res = peek_filepath(info, filepath)))
+        return res;
+
+    unsigned int gen = romsgen(&info->mount->roms);
+    uint64_t start = statsnow();
+    res = stat(filepath, stbuf);
+    peek_sysdone(STATS_STAT, start);
+
+	if (res == -1)
 		return -errno;
 
+    romsput(&info->mount->roms, name, stbuf, gen);
+
     return 0;
 }
 
-static int peek_getattr(const char *path, struct stat *stbuf)
+static int peek_linktarget(struct PathInfo *info, char *buf, size_t size)
 {
-    //printf("peek_getattr: %s\n", path);
+    // The link sits stacklen folders below the source path, one for each
+    // folder in the mount plus the mount itself
+    size_t len = 0;
+    int i;
+    for (i = 0; i < info->stacklen; i++)
+    {
+        if (len + 3 >= size)
+            return -ENAMETOOLONG;
 
-    struct PathInfo info;
-    if (peek_parsepath(&info, path))
-        return -ENOENT;
+        memcpy(buf + len, "../", 3);
+        len += 3;
+    }
 
+    char *name = info->stack[info->stacklen - 1];
+    size_t namelen = strlen(name);
+    if (len + namelen >= size)
+        return -ENAMETOOLONG;
+
+    memcpy(buf + len, name, namelen + 1);
+
+    return len + namelen;
+}
+
+static int peek_getattr_link(struct PathInfo *info, struct stat *stbuf)
+{
     int res;
-    if (info.isfile)
-        res = peek_getattr_file(&info, stbuf);
-    else
-        res = peek_getattr_fakedir(&info, stbuf);
+    if ((res = peek_getattr_file(info, stbuf)))
+        return res;
 
-    peek_parsepathrelease(&info);
+    char target[BUFFER_SIZE];
+    if ((res = peek_linktarget(info, target, BUFFER_SIZE)) < 0)
+        return res;
 
-    return res;
+    stbuf->st_mode = S_IFLNK | 0777;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = res;
+    stbuf->st_blocks = 0;
+
+    return 0;
+}
+
+static int peek_getattr_stats(struct PathInfo *info, struct stat *stbuf)
+{
+    (void) info;
+
+    // The text is made on open and read without the page cache, so the
+    // size doesn't have to be known up front
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+
+    return 0;
+}
+
+static int peek_attr(struct PathInfo *info, struct stat *stbuf)
+{
+    if (info->cmd == PEEKCMD_STATS && info->isfile)
+        return peek_getattr_stats(info, stbuf);
+
+    if (info->isfile)
+        return _opts.symlinks ? peek_getattr_link(info, stbuf) : peek_getattr_file(info, stbuf);
+
+    return peek_getattr_fakedir(info, stbuf);
 }
 
-static void peek_fakefill(void *buf, const char *name, fuse_fill_dir_t filler)
+static void peek_fakefill(void *buf, const char *name, peek_fill_t filler)
 {
     struct stat st;
     memset(&st, 0, sizeof(st));
@@ -221,153 +557,254 @@ static void peek_fakefill(void *buf, const char *name, fuse_fill_dir_t filler)
     filler(buf, name, &st, 0);
 }
 
-static void peek_readdir_filekey(struct PathInfo *info, void *buf, fuse_fill_dir_t filler, char *filekey, int valueoffset)
+static void peek_countfill(struct Database *db, void *buf, const char *name, char *key, peek_fill_t filler)
 {
-    (void) info;
+    unsigned int count;
+    if (dbcount(db, key, &count))
+        count = 0;
 
-    DIR *dp;
-	if ((dp = opendir(_srcpath)) == NULL)
-		return;
-    
-    int fd = dirfd(dp);
+    char counted[BUFFER_SIZE];
+    snprintf(counted, BUFFER_SIZE, "%s (%u)", name, count);
+    peek_fakefill(buf, counted, filler);
+}
+
+static int peek_filefill(void *buf, const char *name, struct stat *st, peek_fill_t filler)
+{
+    if (_opts.symlinks)
+    {
+        struct stat lst = *st;
+        lst.st_mode = S_IFLNK | 0777;
+
+        return filler(buf, name, &lst, 0);
+    }
+
+    return filler(buf, name, st, 0);
+}
+
+static int peek_filestat(struct Mount *mount, DIR **dp, const char *filename, struct stat *st)
+{
+    int found;
+    if ((found = romslookup(&mount->roms, filename, st)) >= 0)
+        return found;
+
+    // The snapshot isn't being kept current, so ask the folder itself
+    if (!*dp && (*dp = peek_srcdir(mount)) == NULL)
+        return -1;
+
+    uint64_t start = statsnow();
+    int res = fstatat(dirfd(*dp), filename, st, 0);
+    peek_sysdone(STATS_STAT, start);
+
+    if (res || !S_ISREG(st->st_mode))
+        return 1;
+
+    return 0;
+}
+
+static void peek_readdir_filekey(struct PathInfo *info, void *buf, peek_fill_t filler, char *filekey, int valueoffset)
+{
+    struct Database *db;
+    if ((db = peek_db()) == NULL)
+        return;
+
+    // Values are joined against the source folder snapshot, so hiding
+    // missing files doesn't cost a stat call each
+    DIR *dp = NULL;
 
-    if (!dbtxnopen(&_db, 1))
+    if (!peek_txnopen(db))
     {
         int rc;
-        if (!dbcuropen(&_db))
+        if (!dbcuropen(db))
         {
             MDB_val dbkey = {strlen(filekey) + 1, filekey};
             MDB_val dbdata;
             struct stat st;
 
-            if (!(rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_SET)))
+            if (!(rc = mdb_cursor_get(db->cur, &dbkey, &dbdata, MDB_SET)))
             {
                 do
                 {
                     if (dbdata.mv_size > valueoffset)
                     {
                         char *filename = (char *)dbdata.mv_data + valueoffset;
-                        if (!fstatat(fd, filename, &st, 0))
+                        if (!peek_filestat(info->mount, &dp, filename, &st))
                         {
-                            if (S_ISREG(st.st_mode))
-                            {
-                                if (filler(buf, filename, &st, 0))
-                                    break;
-                            }
+                            if (peek_filefill(buf, filename, &st, filler))
+                                break;
                         }
                     }
                 }
-                while (!(rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_NEXT_DUP)));
+                while (!(rc = mdb_cursor_get(db->cur, &dbkey, &dbdata, MDB_NEXT_DUP)));
             }
 
-            dbcurclose(&_db);
+            dbcurclose(db);
         }
 
-        dbtxnclose(&_db);
+        peek_txnclose(db);
     }
 
-    closedir(dp);
+    if (dp)
+        closedir(dp);
 }
 
-static void peek_readdir_dbslice(struct PathInfo *info, void *buf, fuse_fill_dir_t filler, char *prefix, char *checkfile)
+static void peek_readdir_dbslice(struct PathInfo *info, void *buf, peek_fill_t filler, char *prefix, char *checkfile)
 {
-    (void) info;
+    struct Database *db;
+    if ((db = peek_db()) == NULL)
+        return;
 
+    int counted = !checkfile && peek_counted(info);
     size_t prefixlen = strlen(prefix);
-    char slice[BUFFER_SIZE];
-    size_t slicelen = 0;
+    char slice[BUFFER_SIZE + 4];
+    char child[BUFFER_SIZE + 1];
 
-    if (!dbtxnopen(&_db, 1))
+    if (prefixlen == 0 || prefixlen >= BUFFER_SIZE || prefix[prefixlen - 1] != '/')
+        return;
+
+    // The slice database is keyed by the parent without its slash
+    memcpy(child, prefix, prefixlen);
+    child[prefixlen - 1] = '\0';
+
+    if (!peek_txnopen(db))
     {
-        if (!dbcuropen(&_db))
+        int rc;
+        MDB_cursor *slicur;
+        if ((rc = mdb_cursor_open(db->txn, db->dbsli, &slicur)))
         {
-            int rc;
-            MDB_cursor *checkcur = NULL;
-            MDB_val dbfile;
-            if (checkfile)
-            {
-                dbfile.mv_size = strlen(checkfile) + 1;
-                dbfile.mv_data = checkfile;
+            printf("Failed to open cursor: %d\n", rc);
+            peek_txnclose(db);
+            return;
+        }
 
-                if ((rc = mdb_cursor_open(_db.txn, _db.dbfil, &checkcur)))
-                {
-                    printf("Failed to open cursor: %d\n", rc);
-                    return;
-                }
+        // The keys holding the file come from the reverse database in
+        // the same order as the children, so both are walked together
+        MDB_cursor *checkcur = NULL;
+        MDB_val dbfile;
+        MDB_val dbcheck = {prefixlen, prefix};
+        int checkrc = MDB_NOTFOUND;
+        if (checkfile)
+        {
+            dbfile.mv_size = strlen(checkfile) + 1;
+            dbfile.mv_data = checkfile;
+
+            if ((rc = mdb_cursor_open(db->txn, db->dbrev, &checkcur)))
+            {
+                printf("Failed to open cursor: %d\n", rc);
+                mdb_cursor_close(slicur);
+                peek_txnclose(db);
+                return;
             }
 
-            MDB_val dbkey = {prefixlen + 1, prefix};
-            MDB_val dbdata;
+            checkrc = mdb_cursor_get(checkcur, &dbfile, &dbcheck, MDB_GET_BOTH_RANGE);
+        }
+
+        // Exactly the distinct children, however much data is below them
+        MDB_val dbkey = {prefixlen, child};
+        MDB_val dbdata;
+
+        rc = mdb_cursor_get(slicur, &dbkey, &dbdata, MDB_SET);
+        child[prefixlen - 1] = '/';
+
+        while (!rc)
+        {
+            if (dbdata.mv_size == 0 || prefixlen + dbdata.mv_size > BUFFER_SIZE)
+                break;
+
+            size_t curlen = dbdata.mv_size - 1;
 
-            if (!(rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_SET_RANGE)))
+            memcpy(child + prefixlen, dbdata.mv_data, curlen);
+            child[prefixlen + curlen] = '\0';
+
+            // Checkboxes only stand for the key itself, so a child with
+            // levels below it is listed again as a folder for those
+            int folder = 1;
+            int checkbox = 0;
+            if (checkfile)
             {
-                do
-                {
-                    if (prefixlen > dbkey.mv_size || memcmp(prefix, dbkey.mv_data, prefixlen) != 0)
-                        break;
-                    
-                    char *curstart = (char *)dbkey.mv_data + prefixlen;
-                    char *curend = strchr(curstart, '/');
-                    size_t curlen = curend ? (size_t)(curend - curstart) : (dbkey.mv_size - 1 - prefixlen);
-
-                    if (slicelen != curlen || memcmp(slice, curstart, slicelen) != 0)
-                    {
-                        int sliceindex = 0;
+                MDB_val childkey = {prefixlen + curlen + 1, child};
+                MDB_val childdata;
+                folder = !mdb_get(db->txn, db->dbsli, &childkey, &childdata);
+                checkbox = !folder || !mdb_get(db->txn, db->dbfil, &childkey, &childdata);
+            }
 
-                        if (checkfile)
-                        {
-                            int has = !(rc = mdb_cursor_get(_db.cur, &dbkey, &dbfile, MDB_GET_BOTH));
+            if (checkbox)
+            {
+                MDB_val checkkey = {prefixlen + curlen + 1, child};
+                while (!checkrc && mdb_dcmp(db->txn, db->dbrev, &dbcheck, &checkkey) < 0)
+                    checkrc = mdb_cursor_get(checkcur, &dbfile, &dbcheck, MDB_NEXT_DUP);
 
-                            slice[0] = '[';
-                            slice[1] = has ? 'X' : ' ';
-                            slice[2] = ']';
-                            slice[3] = ' ';
-                            sliceindex = 4;
-                        }
+                int has = !checkrc && mdb_dcmp(db->txn, db->dbrev, &dbcheck, &checkkey) == 0;
 
-                        memcpy(slice + sliceindex, curstart, curlen);
-                        slice[curlen + sliceindex] = '\0';
-                        slicelen = curlen;
+                int pending;
+                if ((pending = queuepending(&_queue, child, checkfile)) >= 0)
+                    has = pending;
 
-                        peek_fakefill(buf, slice, filler);
-                    }
-                }
-                while (!(rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_NEXT_NODUP)));
+                snprintf(slice, sizeof(slice), "[%c] %s", has ? 'X' : ' ', child + prefixlen);
+                peek_fakefill(buf, slice, filler);
             }
 
-            if (checkfile)
-                mdb_cursor_close(checkcur);
+            if (folder)
+            {
+                memcpy(slice, child + prefixlen, curlen);
+                slice[curlen] = '\0';
+
+                if (counted)
+                    peek_countfill(db, buf, slice, child, filler);
+                else
+                    peek_fakefill(buf, slice, filler);
+            }
 
-            dbcurclose(&_db);
+            rc = mdb_cursor_get(slicur, &dbkey, &dbdata, MDB_NEXT_DUP);
         }
 
-        dbtxnclose(&_db);
+        if (checkfile)
+            mdb_cursor_close(checkcur);
+
+        mdb_cursor_close(slicur);
+
+        peek_txnclose(db);
     }
 }
 
-static void peek_readdir_root(struct PathInfo *info, void *buf, fuse_fill_dir_t filler)
+static void peek_readdir_root(struct PathInfo *info, void *buf, peek_fill_t filler)
 {
-    (void) info;
+    struct Database *db;
+    if (peek_counted(info) && (db = peek_db()) && !peek_txnopen(db))
+    {
+        char key[BUFFER_SIZE];
+        snprintf(key, BUFFER_SIZE, "fav/%s", info->mount->corename);
+        peek_countfill(db, buf, __favpath, key, filler);
+
+        snprintf(key, BUFFER_SIZE, "rec/%s", info->mount->corename);
+        peek_countfill(db, buf, __recpath, key, filler);
+
+        peek_txnclose(db);
+    }
+    else
+    {
+        peek_fakefill(buf, __favpath, filler);
+        peek_fakefill(buf, __recpath, filler);
+    }
 
-    peek_fakefill(buf, __favpath, filler);
-    peek_fakefill(buf, __recpath, filler);
     peek_fakefill(buf, __alphapath, filler);
+    peek_fakefill(buf, __searchpath, filler);
     peek_fakefill(buf, __managepath, filler);
+    peek_fakefill(buf, __statspath, filler);
 
     char prefix[BUFFER_SIZE];
-    sprintf(prefix, "has/%s/", _corename);
+    sprintf(prefix, "has/%s/", info->mount->corename);
     peek_readdir_dbslice(info, buf, filler, prefix, NULL);
 }
 
-static void peek_readdir_fav(struct PathInfo *info, void *buf, fuse_fill_dir_t filler)
+static void peek_readdir_fav(struct PathInfo *info, void *buf, peek_fill_t filler)
 {
     char filekey[BUFFER_SIZE];
-    sprintf(filekey, "fav/%s", _corename);
+    sprintf(filekey, "fav/%s", info->mount->corename);
 
     peek_readdir_filekey(info, buf, filler, filekey, 0);
 }
 
-static void peek_readdir_alpha_root(struct PathInfo *info, void *buf, fuse_fill_dir_t filler)
+static void peek_readdir_alpha_root(struct PathInfo *info, void *buf, peek_fill_t filler)
 {
     (void) info;
 
@@ -381,13 +818,34 @@ static void peek_readdir_alpha_root(struct PathInfo *info, void *buf, fuse_fill_
     }
 }
 
-static void peek_readdir_alpha_letter(struct PathInfo *info, void *buf, fuse_fill_dir_t filler)
+struct FillArgs
 {
-    (void) info;
+    void *buf;
+    peek_fill_t filler;
+};
 
-	DIR *dp;
-	if ((dp = opendir(_srcpath)) == NULL)
-		return;
+static int peek_filefill_each(void *arg, const char *name, const struct stat *st)
+{
+    struct FillArgs *fill = (struct FillArgs *)arg;
+    struct stat tmp = *st;
+
+    return peek_filefill(fill->buf, name, &tmp, fill->filler);
+}
+
+static void peek_readdir_alpha_letter(struct PathInfo *info, void *buf, peek_fill_t filler)
+{
+    // Use the letter index when it is current, otherwise fall back
+    // to scanning the whole folder
+    char letter = info->stack[1][0];
+    int index = (letter >= 'A' && letter <= 'Z') ? romsletterindex(letter) : 0;
+
+    struct FillArgs fill = { buf, filler };
+    if (!romsletter(&info->mount->roms, index, peek_filefill_each, &fill))
+        return;
+
+    DIR *dp;
+    if ((dp = peek_srcdir(info->mount)) == NULL)
+        return;
 
     char letter1 = info->stack[1][0];
     char letter2;
@@ -423,7 +881,7 @@ static void peek_readdir_alpha_letter(struct PathInfo *info, void *buf, fuse_fil
             st.st_ino = de->d_ino;
             st.st_mode = de->d_type << 12;
 
-            if (filler(buf, de->d_name, &st, 0))
+            if (peek_filefill(buf, de->d_name, &st, filler))
                 break;
         }
 	}
@@ -431,41 +889,251 @@ static void peek_readdir_alpha_letter(struct PathInfo *info, void *buf, fuse_fil
 	closedir(dp);
 }
 
-static void peek_readdir_rec(struct PathInfo *info, void *buf, fuse_fill_dir_t filler)
+static void peek_readdir_rec(struct PathInfo *info, void *buf, peek_fill_t filler)
 {
     char filekey[BUFFER_SIZE];
-    sprintf(filekey, "rec/%s", _corename);
+    sprintf(filekey, "rec/%s", info->mount->corename);
 
     peek_readdir_filekey(info, buf, filler, filekey, TIME_LEN);
 }
 
-static void peek_readdir_has_level1(struct PathInfo *info, void *buf, fuse_fill_dir_t filler)
+static int peek_idfill(struct PathInfo *info, struct Database *db, MDB_val *data, DIR **dp, void *buf, peek_fill_t filler)
 {
-    (void) info;
+    unsigned int id;
+    if (data->mv_size != sizeof(id))
+        return 0;
 
-    char prefix[BUFFER_SIZE];
-    sprintf(prefix, "has/%s/%s/", _corename, info->stack[0]);
-    peek_readdir_dbslice(info, buf, filler, prefix, NULL);
+    memcpy(&id, data->mv_data, sizeof(id));
+
+    char *filename;
+    struct stat st;
+    if ((filename = dbstrget(db, id)) == NULL || peek_filestat(info->mount, dp, filename, &st))
+        return 0;
+
+    return peek_filefill(buf, filename, &st, filler);
 }
 
-static void peek_readdir_has_level2(struct PathInfo *info, void *buf, fuse_fill_dir_t filler)
+// One facet's file ids, read a page at a time
+struct IdPage
 {
-    char filekey[BUFFER_SIZE];
-    sprintf(filekey, "has/%s/%s/%s", _corename, info->stack[0], info->stack[1]);
-    peek_readdir_filekey(info, buf, filler, filekey, 0);
+    MDB_cursor *cur;
+    MDB_val key;
+    char *ids;
+    size_t len;
+    size_t pos;
+};
+
+static unsigned int peek_idat(struct IdPage *page, size_t i)
+{
+    unsigned int id;
+    memcpy(&id, page->ids + i * sizeof(id), sizeof(id));
+
+    return id;
 }
 
-static void peek_readdir_manage_root(struct PathInfo *info, void *buf, fuse_fill_dir_t filler)
+static int peek_idload(struct IdPage *page, MDB_cursor_op op)
 {
-    (void) info;
+    MDB_val key = page->key;
+    MDB_val data;
+    if (mdb_cursor_get(page->cur, &key, &data, op) || data.mv_size < sizeof(unsigned int))
+        return -1;
 
-    DIR *dp;
-	if ((dp = opendir(_srcpath)) == NULL)
-		return;
-    
-	struct dirent *de;
-	while ((de = readdir(dp)) != NULL)
-    {
+    page->ids = data.mv_data;
+    page->len = data.mv_size / sizeof(unsigned int);
+    page->pos = 0;
+
+    return 0;
+}
+
+static int peek_idnext(struct IdPage *page)
+{
+    if (++page->pos < page->len)
+        return 0;
+
+    return peek_idload(page, MDB_NEXT_MULTIPLE);
+}
+
+static int peek_idseek(struct IdPage *page, unsigned int target)
+{
+    // Past the end of the page, the cursor jumps straight to the page
+    // holding the target, which may start below it
+    if (peek_idat(page, page->len - 1) < target)
+    {
+        MDB_val key = page->key;
+        MDB_val data = {sizeof(target), &target};
+        if (mdb_cursor_get(page->cur, &key, &data, MDB_GET_BOTH_RANGE) || peek_idload(page, MDB_GET_MULTIPLE))
+            return -1;
+    }
+
+    // Ids are sorted, so the first one not below the target is a binary
+    // search away
+    size_t lo = page->pos;
+    size_t hi = page->len;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (peek_idat(page, mid) < target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == page->len)
+        return -1;
+
+    page->pos = lo;
+
+    return 0;
+}
+
+static void peek_readdir_intersect(struct PathInfo *info, struct Database *db, MDB_cursor **curs, MDB_val *keys, int count, DIR **dp, void *buf, peek_fill_t filler)
+{
+    struct IdPage pages[PEEK_CONSTRAINTS];
+    int k;
+    for (k = 0; k < count; k++)
+    {
+        MDB_val key = keys[k];
+        MDB_val data;
+        pages[k].cur = curs[k];
+        pages[k].key = keys[k];
+        if (mdb_cursor_get(curs[k], &key, &data, MDB_SET) || peek_idload(&pages[k], MDB_GET_MULTIPLE))
+            return;
+    }
+
+    // Leapfrog join over pages of ids: each list in turn moves to its
+    // first id not below the candidate, mostly without leaving the page
+    // it has. Once every list has landed on the candidate, it is in all
+    // of them. A single facet just walks its pages.
+    unsigned int candidate = peek_idat(&pages[0], 0);
+    int agreed = 1;
+    k = 0;
+    while (1)
+    {
+        if (agreed == count)
+        {
+            MDB_val one = {sizeof(candidate), &candidate};
+            if (peek_idfill(info, db, &one, dp, buf, filler))
+                break;
+
+            if (peek_idnext(&pages[k]))
+                break;
+
+            candidate = peek_idat(&pages[k], pages[k].pos);
+            agreed = 1;
+            continue;
+        }
+
+        k = (k + 1) % count;
+        if (peek_idseek(&pages[k], candidate))
+            break;
+
+        unsigned int id = peek_idat(&pages[k], pages[k].pos);
+        if (id == candidate)
+        {
+            agreed++;
+        }
+        else
+        {
+            candidate = id;
+            agreed = 1;
+        }
+    }
+}
+
+static void peek_readdir_has_files(struct PathInfo *info, void *buf, peek_fill_t filler)
+{
+    struct Database *db;
+    if ((db = peek_db()) == NULL)
+        return;
+
+    // Each facet picked along the path, split by refine folders, narrows
+    // the listing. The last one is the facet being browsed.
+    char keybuf[BUFFER_SIZE];
+    MDB_val keys[PEEK_CONSTRAINTS];
+    size_t keylen = 0;
+    int count = 0;
+    int from = 0;
+    int i;
+    for (i = 0; i <= info->stacklen; i++)
+    {
+        if (i < info->stacklen && strcmp(info->stack[i], __refinepath) != 0)
+            continue;
+
+        int len;
+        if (count == PEEK_CONSTRAINTS || (len = peek_haskey(info, from, i, keybuf + keylen, BUFFER_SIZE - keylen)) < 0)
+            return;
+
+        keys[count].mv_size = len + 1;
+        keys[count].mv_data = keybuf + keylen;
+        keylen += len + 1;
+        count++;
+        from = i + 1;
+    }
+
+    DIR *dp = NULL;
+
+    if (!peek_txnopen(db))
+    {
+        MDB_val dbdata;
+        if (!mdb_get(db->txn, db->dbfid, &keys[count - 1], &dbdata))
+        {
+            peek_fakefill(buf, __refinepath, filler);
+
+            int rc = 0;
+            MDB_cursor *curs[PEEK_CONSTRAINTS];
+
+            int opened;
+            for (opened = 0; opened < count; opened++)
+            {
+                if ((rc = mdb_cursor_open(db->txn, db->dbfid, &curs[opened])))
+                {
+                    printf("Failed to open cursor: %d\n", rc);
+                    break;
+                }
+            }
+
+            if (!rc)
+                peek_readdir_intersect(info, db, curs, keys, count, &dp, buf, filler);
+
+            for (i = 0; i < opened; i++)
+                mdb_cursor_close(curs[i]);
+        }
+
+        peek_txnclose(db);
+    }
+
+    if (dp)
+        closedir(dp);
+}
+
+static void peek_readdir_has(struct PathInfo *info, void *buf, peek_fill_t filler)
+{
+    int seg = peek_hasseg(info, info->stacklen);
+
+    // Deeper levels of the facet being browsed
+    int len;
+    char prefix[BUFFER_SIZE];
+    if ((len = peek_haskey(info, seg, info->stacklen, prefix, BUFFER_SIZE - 1)) < 0)
+        return;
+
+    prefix[len] = '/';
+    prefix[len + 1] = '\0';
+    peek_readdir_dbslice(info, buf, filler, prefix, NULL);
+
+    // Right after a refine folder there is only the next facet to pick
+    if (seg < info->stacklen)
+        peek_readdir_has_files(info, buf, filler);
+}
+
+static void peek_readdir_manage_root(struct PathInfo *info, void *buf, peek_fill_t filler)
+{
+    DIR *dp;
+	if ((dp = peek_srcdir(info->mount)) == NULL)
+		return;
+    
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL)
+    {
         if (de->d_type == 8 /* DT_REG */)
         {
             peek_fakefill(buf, de->d_name, filler);
@@ -475,331 +1143,2143 @@ static void peek_readdir_manage_root(struct PathInfo *info, void *buf, fuse_fill
     closedir(dp);
 }
 
-static void peek_readdir_manage_file(struct PathInfo *info, void *buf, fuse_fill_dir_t filler)
+static void peek_readdir_manage_file(struct PathInfo *info, void *buf, peek_fill_t filler)
 {
+    struct Database *db;
+    if ((db = peek_db()) == NULL)
+        return;
+
     char *file = info->stack[1];
 
     // Read if favorite
-    if (!dbtxnopen(&_db, 1))
+    if (!peek_txnopen(db))
     {
         int rc;
 
-        if (!dbcuropen(&_db))
+        if (!dbcuropen(db))
         {
             char tmp[BUFFER_SIZE];
-            sprintf(tmp, "fav/%s", _corename);
+            sprintf(tmp, "fav/%s", info->mount->corename);
 
             MDB_val dbkey = {strlen(tmp) + 1, tmp};
             MDB_val dbdata = {strlen(file) + 1, file};
 
-            int fav = !(rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_GET_BOTH));
+            int fav = !(rc = mdb_cursor_get(db->cur, &dbkey, &dbdata, MDB_GET_BOTH));
+
+            int pending;
+            if ((pending = queuepending(&_queue, tmp, file)) >= 0)
+                fav = pending;
 
             sprintf(tmp, "[%c] %s", fav ? 'X' : ' ', __managefav);
             peek_fakefill(buf, tmp, filler);
 
-            dbcurclose(&_db);
+            dbcurclose(db);
         }
 
-        dbtxnclose(&_db);
+        peek_txnclose(db);
     }
 
     // Read level 1 filters
     char prefix[BUFFER_SIZE];
-    sprintf(prefix, "has/%s/", _corename);
+    sprintf(prefix, "has/%s/", info->mount->corename);
     peek_readdir_dbslice(info, buf, filler, prefix, NULL);
 }
 
-static void peek_readdir_manage_yay(struct PathInfo *info, void *buf, fuse_fill_dir_t filler)
+static void peek_readdir_manage_yay(struct PathInfo *info, void *buf, peek_fill_t filler)
 {
     (void) info;
     
     peek_fakefill(buf, __manageyay, filler);
 }
 
-static void peek_readdir_manage_setfav(struct PathInfo *info, void *buf, fuse_fill_dir_t filler, int checked)
+static int peek_readdir_manage_isset(char *key, char *file)
 {
-    char *file = info->stack[1];
+    // Anything still queued is newer than the database
+    int set;
+    if ((set = queuepending(&_queue, key, file)) >= 0)
+        return set;
+
+    struct Database *db;
+    if ((db = peek_db()) == NULL)
+        return -1;
 
-    if (!dbtxnopen(&_db, 0))
+    if (!peek_txnopen(db))
     {
-        if (!dbcuropen(&_db))
+        if (!dbcuropen(db))
         {
-            char tmp[BUFFER_SIZE];
-            sprintf(tmp, "fav/%s", _corename);
-
-            if (checked == 1)
-                dbdel(&_db, tmp, file);
-            else
-                dbput(&_db, tmp, file);
-
-            peek_readdir_manage_yay(info, buf, filler);
+            MDB_val dbkey = {strlen(key) + 1, key};
+            MDB_val dbdata = {strlen(file) + 1, file};
+            set = !mdb_cursor_get(db->cur, &dbkey, &dbdata, MDB_GET_BOTH);
 
-            dbcurclose(&_db);
+            dbcurclose(db);
         }
 
-        dbtxnclose(&_db);
+        peek_txnclose(db);
     }
+
+    return set;
 }
 
-static void peek_readdir_manage_sethas(struct PathInfo *info, void *buf, fuse_fill_dir_t filler)
+static void peek_readdir_manage_set(struct PathInfo *info, void *buf, peek_fill_t filler, char *key, int checked)
 {
     char *file = info->stack[1];
-    char *level1 = info->stack[2];
 
-    int checked;
-    char *level2 = trimcheck(info->stack[3], &checked);
+    // The name asks for the opposite of the state it shows, so listing it
+    // again, or a name left over from an older listing, changes nothing
+    int set = checked != 1;
 
-    if (!dbtxnopen(&_db, 0))
-    {
-        if (!dbcuropen(&_db))
-        {
-            char tmp[BUFFER_SIZE];
-            sprintf(tmp, "has/%s/%s/%s", _corename, level1, level2);
+    // Queued, so the menu never waits on the SD card
+    if (peek_readdir_manage_isset(key, file) != set && queueput(&_queue, !set, key, file))
+        return;
 
-            if (checked == 1)
-                dbdel(&_db, tmp, file);
-            else
-                dbput(&_db, tmp, file);
+    peek_readdir_manage_yay(info, buf, filler);
+}
 
-            peek_readdir_manage_yay(info, buf, filler);
+static void peek_readdir_manage_setfav(struct PathInfo *info, void *buf, peek_fill_t filler, int checked)
+{
+    char tmp[BUFFER_SIZE];
+    sprintf(tmp, "fav/%s", info->mount->corename);
 
-            dbcurclose(&_db);
-        }
+    peek_readdir_manage_set(info, buf, filler, tmp, checked);
+}
 
-        dbtxnclose(&_db);
-    }
+static void peek_readdir_manage_sethas(struct PathInfo *info, void *buf, peek_fill_t filler)
+{
+    int last = info->stacklen - 1;
+
+    int checked;
+    char *value = trimcheck(info->stack[last], &checked);
+
+    // The value belongs to the facet made of every level above it
+    int len;
+    char tmp[BUFFER_SIZE];
+    if ((len = peek_haskey(info, 2, last, tmp, BUFFER_SIZE)) < 0
+        || snprintf(tmp + len, BUFFER_SIZE - len, "/%s", value) >= BUFFER_SIZE - len)
+        return;
+
+    peek_readdir_manage_set(info, buf, filler, tmp, checked);
 }
 
-static void peek_readdir_manage_level3(struct PathInfo *info, void *buf, fuse_fill_dir_t filler)
+static void peek_readdir_manage_level(struct PathInfo *info, void *buf, peek_fill_t filler)
 {
     int checked;
-    char *level = trimcheck(info->stack[2], &checked);
+    char *level = trimcheck(info->stack[info->stacklen - 1], &checked);
+
+    if (checked == -1)
+    {
+        // A facet, or a level of one, with checkboxes for the values that
+        // hold files and folders for those with levels below them
+        int len;
+        char prefix[BUFFER_SIZE];
+        if ((len = peek_haskey(info, 2, info->stacklen, prefix, BUFFER_SIZE - 1)) < 0)
+            return;
 
-    if (strcmp(level, __managefav) == 0)
+        prefix[len] = '/';
+        prefix[len + 1] = '\0';
+        peek_readdir_dbslice(info, buf, filler, prefix, info->stack[1]);
+    }
+    else if (info->stacklen == 3)
     {
-        peek_readdir_manage_setfav(info, buf, filler, checked);
+        // Right below the file, the only checkbox is its favorite
+        if (strcmp(level, __managefav) == 0)
+            peek_readdir_manage_setfav(info, buf, filler, checked);
     }
     else
     {
-        char *file = info->stack[1];
-
-        char prefix[BUFFER_SIZE];
-        sprintf(prefix, "has/%s/%s/", _corename, level);
-        peek_readdir_dbslice(info, buf, filler, prefix, file);
+        peek_readdir_manage_sethas(info, buf, filler);
     }
 }
 
-static int peek_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+struct SearchFill
 {
-    //printf("peek_readdir: %s\n", path);
+    struct Mount *mount;
+    DIR *dp;
+    void *buf;
+    peek_fill_t filler;
+};
 
-	(void) offset;
-	(void) fi;
+static int peek_readdir_search_each(void *arg, char *name)
+{
+    struct SearchFill *fill = (struct SearchFill *)arg;
 
-    struct PathInfo info;
-    if (peek_parsepath(&info, path))
-        return -ENOENT;
+    // The index may still hold files that were removed since the last
+    // scan, so they are joined against the folder like everything else
+    struct stat st;
+    if (peek_filestat(fill->mount, &fill->dp, name, &st))
+        return 0;
+
+    return peek_filefill(fill->buf, name, &st, fill->filler);
+}
+
+static void peek_readdir_search(struct PathInfo *info, void *buf, peek_fill_t filler)
+{
+    // Search itself is empty, the query is the name of the folder below it
+    if (info->stacklen != 2)
+        return;
+
+    struct Database *db;
+    if ((db = peek_db()) == NULL)
+        return;
+
+    struct SearchFill fill = { info->mount, NULL, buf, filler };
+
+    if (!peek_txnopen(db))
+    {
+        dbsearch(db, info->mount->corename, info->stack[1], peek_readdir_search_each, &fill);
+        peek_txnclose(db);
+    }
+
+    if (fill.dp)
+        closedir(fill.dp);
+}
+
+static void peek_readdir_stats(struct PathInfo *info, void *buf, peek_fill_t filler)
+{
+    (void) info;
+
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG;
 
-    peek_fakefill(buf, ".", filler);
-    peek_fakefill(buf, "..", filler);
+    filler(buf, __statslatency, &st, 0);
+}
 
-    switch (info.cmd)
+static void peek_readdir_build(struct PathInfo *info, void *buf, peek_fill_t filler)
+{
+    switch (info->cmd)
     {
         case PEEKCMD_ROOT:
-            peek_readdir_root(&info, buf, filler);
+            peek_readdir_root(info, buf, filler);
             break;
 
         case PEEKCMD_FAV:
-            peek_readdir_fav(&info, buf, filler);
+            peek_readdir_fav(info, buf, filler);
             break;
 
         case PEEKCMD_ALPHA:
-            switch (info.stacklen)
+            switch (info->stacklen)
             {
                 case 1:
-                    peek_readdir_alpha_root(&info, buf, filler);
+                    peek_readdir_alpha_root(info, buf, filler);
                     break;
 
                 case 2:
-                    peek_readdir_alpha_letter(&info, buf, filler);
+                    peek_readdir_alpha_letter(info, buf, filler);
                     break;
             }
             break;
 
         case PEEKCMD_REC:
-            peek_readdir_rec(&info, buf, filler);
+            peek_readdir_rec(info, buf, filler);
             break;
 
         case PEEKCMD_HAS:
-            switch (info.stacklen)
-            {
-                case 1:
-                    peek_readdir_has_level1(&info, buf, filler);
-                    break;
-
-                case 2:
-                    peek_readdir_has_level2(&info, buf, filler);
-                    break;
-            }
+            peek_readdir_has(info, buf, filler);
             break;
 
         case PEEKCMD_MANAGE:
-            switch (info.stacklen)
+            switch (info->stacklen)
             {
                 case 1:
-                    peek_readdir_manage_root(&info, buf, filler);
+                    peek_readdir_manage_root(info, buf, filler);
                     break;
 
                 case 2:
-                    peek_readdir_manage_file(&info, buf, filler);
+                    peek_readdir_manage_file(info, buf, filler);
                     break;
 
-                case 3:
-                    peek_readdir_manage_level3(&info, buf, filler);
-                    break;
-
-                case 4:
-                    peek_readdir_manage_sethas(&info, buf, filler);
+                default:
+                    peek_readdir_manage_level(info, buf, filler);
                     break;
             }
             break;
-    }
 
-    peek_parsepathrelease(&info);
+        case PEEKCMD_SEARCH:
+            peek_readdir_search(info, buf, filler);
+            break;
 
-    return 0;
+        case PEEKCMD_STATS:
+            peek_readdir_stats(info, buf, filler);
+            break;
+    }
 }
 
-static int peek_open(const char *path, struct fuse_file_info *fi)
+static int peek_cacheable(struct PathInfo *info)
 {
-    //printf("peek_open: %s\n", path);
+    // Checkboxes also show changes that are still queued, and listing
+    // the folders below them queues a change, so they must run every time
+    if (info->cmd == PEEKCMD_MANAGE && info->stacklen >= 2)
+        return 0;
 
-    struct PathInfo info;
-    if (peek_parsepath(&info, path))
-        return -ENOENT;
+    return 1;
+}
 
-    if (!info.isfile)
-        return -ENOENT;
+static void peek_version(struct Mount *mount, size_t *txnid, struct timespec *mtime)
+{
+    MDB_envinfo envinfo;
+    struct stat st;
 
-    int fd;
-    if ((fd = open(info.filepath, fi->flags)) == -1)
-        return -errno;
+    if (mdb_env_info(_db.env, &envinfo))
+        envinfo.me_last_txnid = 0;
 
-    fi->fh = fd;
+    uint64_t start = statsnow();
+    if (stat(mount->srcpath, &st) == -1)
+        memset(&st, 0, sizeof(st));
 
-    return 0;
+    peek_sysdone(STATS_STAT, start);
+
+    *txnid = envinfo.me_last_txnid;
+    *mtime = st.st_mtim;
 }
 
-static int peek_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+static struct Listing *peek_listing(struct PathInfo *info)
 {
-    //printf("peek_read: %s\n", path);
+    size_t txnid;
+    struct timespec mtime;
+    peek_version(info->mount, &txnid, &mtime);
 
-    (void) path;
+    int cacheable = peek_cacheable(info);
 
-    int res;
-    if ((res = pread(fi->fh, buf, size, offset)) == -1)
-        res = -errno;
+    struct Listing *listing;
+    if (cacheable && (listing = cacheget(&info->mount->cache, info->path, txnid, &mtime)))
+        return listing;
 
-    return res;
+    if ((listing = listingnew(info->path, txnid, &mtime)) == NULL)
+        return NULL;
+
+    uint64_t start = statsnow();
+    peek_readdir_build(info, listing, listingfill);
+    statsadd(&_stats, STATS_BUILD, start);
+
+    if (cacheable)
+        cacheput(&info->mount->cache, listing);
+
+    return listing;
 }
 
-static int peek_release(const char *path, struct fuse_file_info *fi)
+static struct PathInfo *peek_node(fuse_req_t req, fuse_ino_t ino)
 {
-    //printf("peek_release: %s\n", path);
+    struct Mount *mount = (struct Mount *)fuse_req_userdata(req);
 
-    (void) path;
-    close(fi->fh);
+    struct Node *node;
+    if ((node = nodeget(&mount->nodes, ino)) == NULL)
+        return NULL;
 
-	return 0;
+    return &node->info;
 }
 
-static struct fuse_operations peek_oper = {
-	.getattr	= peek_getattr,
-	.readdir	= peek_readdir,
-	.open		= peek_open,
-	.read		= peek_read,
-	.release	= peek_release
-};
+static void peek_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void) userdata;
 
-static int initialize(void)
+    // Splicing is opt-in, and needed for read to avoid the copy
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+        conn->want |= FUSE_CAP_SPLICE_MOVE;
+}
+
+static void peek_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    if (dbopen(&_db))
-        return -1;
-    
-    return 0;
+    //printf("peek_lookup: %lu %s\n", parent, name);
+
+    struct Mount *mount = (struct Mount *)fuse_req_userdata(req);
+
+    struct Node *node;
+    if ((node = nodeget(&mount->nodes, parent)) == NULL)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+
+    char uncounted[BUFFER_SIZE];
+    name = peek_uncount(&node->info, name, uncounted, BUFFER_SIZE);
+
+    int res;
+    struct PathInfo info;
+    if ((res = peek_childinfo(&node->info, name, &info)) || (res = peek_attr(&info, &e.attr)))
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    struct Node *child;
+    if ((child = nodeadd(&mount->nodes, node, &info)) == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    nodeattr(&mount->nodes, child, &e.attr);
+
+    e.ino = child->ino;
+    e.attr.st_ino = child->ino;
+    e.attr_timeout = PEEK_TIMEOUT;
+    e.entry_timeout = PEEK_TIMEOUT;
+
+    // The kernel only counts the lookup if the reply got through
+    if (fuse_reply_entry(req, &e))
+        nodeforget(&mount->nodes, child->ino, 1);
 }
 
-static void cleanup(void)
+static void peek_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
 {
-    dbclose(&_db);
+    struct Mount *mount = (struct Mount *)fuse_req_userdata(req);
+
+    nodeforget(&mount->nodes, ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void peek_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+    struct Mount *mount = (struct Mount *)fuse_req_userdata(req);
+
+    size_t i;
+    for (i = 0; i < count; i++)
+        nodeforget(&mount->nodes, forgets[i].ino, forgets[i].nlookup);
+
+    fuse_reply_none(req);
 }
 
-static int fuse_main_peek(int argc, char *argv[], const struct fuse_operations *op, size_t op_size, void *user_data)
+static void peek_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	struct fuse *fuse;
-	char *mountpoint;
-	int multithreaded;
-	int res;
+    //printf("peek_getattr: %lu\n", ino);
+
+    (void) fi;
+
+    struct Mount *mount = (struct Mount *)fuse_req_userdata(req);
+
+    struct Node *node;
+    if ((node = nodeget(&mount->nodes, ino)) == NULL)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
-	fuse = fuse_setup(argc, argv, op, op_size, &mountpoint, &multithreaded, user_data);
-	if (fuse == NULL)
+    int res;
+    struct stat st;
+    if ((res = peek_attr(&node->info, &st)))
     {
-        printf("Fuse setup failed\n");
-		return 1;
+        fuse_reply_err(req, -res);
+        return;
     }
 
-    printf("Mount path: %s\n", mountpoint);
+    nodeattr(&mount->nodes, node, &st);
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, PEEK_TIMEOUT);
+}
+
+static int peek_checkkey(struct PathInfo *parent, const char *name, char *key, size_t size)
+{
+    int checked;
+    char *value = trimcheck((char *)name, &checked);
+
+    // Only checkboxes can be changed, everything else is read-only
+    if (!peek_ischeckbox(parent, value))
+        return -EPERM;
+
+    // A value belongs to the facet made of every level above it
+    int len;
+    if (parent->stacklen == 2)
+        len = snprintf(key, size, "fav/%s", parent->mount->corename);
+    else if ((len = peek_haskey(parent, 2, parent->stacklen, key, size)) >= 0)
+        len += snprintf(key + len, size - len, "/%s", value);
+
+    if (len < 0 || (size_t)len >= size)
+        return -ENAMETOOLONG;
+
+    return 0;
+}
+
+static void peek_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    //printf("peek_mkdir: %lu %s\n", parent, name);
+
+    (void) mode;
+
+    struct Mount *mount = (struct Mount *)fuse_req_userdata(req);
 
-    int mountlen = strlen(mountpoint);
-    _mountpath = malloc(mountlen + 1);
-    strcpy(_mountpath, mountpoint);
+    struct Node *node;
+    if ((node = nodeget(&mount->nodes, parent)) == NULL)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
-    if ((_srcpath = pathup(_mountpath)))
+    // Making a checkbox, by its bare name or with any state, checks it
+    int res;
+    char key[BUFFER_SIZE];
+    if ((res = peek_checkkey(&node->info, name, key, BUFFER_SIZE)))
     {
-        printf("Source path: %s\n", _srcpath);
+        fuse_reply_err(req, -res);
+        return;
+    }
 
-        if ((_corename = pathfile(_srcpath)))
-        {
-            printf("Core name: %s\n", _corename);
+    if (queueput(&_queue, 0, key, node->info.stack[1]))
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
 
-            if (multithreaded)
-                res = fuse_loop_mt(fuse);
-            else
-                res = fuse_loop(fuse);
-        }
-        else
-        {
-            printf("Failed to get core name\n");
-            res = -1;
-        }
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+
+    struct PathInfo info;
+    struct Node *child;
+    if ((res = peek_childinfo(&node->info, name, &info)) == -ENOENT)
+    {
+        // A bare name never exists, so it is handed out as if it had the
+        // state it now has
+        char checkname[BUFFER_SIZE];
+        snprintf(checkname, BUFFER_SIZE, "[X] %s", name);
+        res = peek_childinfo(&node->info, checkname, &info);
     }
-    else
+
+    if (res || (res = peek_attr(&info, &e.attr)))
     {
-        printf("Failed to get source path\n");
-        res = -1;
+        fuse_reply_err(req, -res);
+        return;
     }
 
-	fuse_teardown(fuse, mountpoint);
-	if (res == -1)
-		return 1;
+    if ((child = nodeadd(&mount->nodes, node, &info)) == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    nodeattr(&mount->nodes, child, &e.attr);
+
+    // The name is not kept, since the next listing shows it with its
+    // state instead
+    e.ino = child->ino;
+    e.attr.st_ino = child->ino;
+    e.attr_timeout = PEEK_TIMEOUT;
+    e.entry_timeout = 0;
 
-	return 0;
+    if (fuse_reply_entry(req, &e))
+        nodeforget(&mount->nodes, child->ino, 1);
 }
 
-int main(int argc, char *argv[])
+static void peek_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    printf("Starting up...\n");
+    //printf("peek_rmdir: %lu %s\n", parent, name);
 
-    if (initialize())
-        return 1;
+    struct Mount *mount = (struct Mount *)fuse_req_userdata(req);
 
-    umask(0);
-    int err = fuse_main_peek(argc, argv, &peek_oper, sizeof(peek_oper), NULL);
+    struct Node *node;
+    if ((node = nodeget(&mount->nodes, parent)) == NULL)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
-    printf("\n");
-    printf("Cleaning up!\n");
+    // Removing a checkbox unchecks it
+    int res;
+    char key[BUFFER_SIZE];
+    if ((res = peek_checkkey(&node->info, name, key, BUFFER_SIZE)))
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fuse_reply_err(req, queueput(&_queue, 1, key, node->info.stack[1]) ? ENOMEM : 0);
+}
+
+static void peek_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname)
+{
+    //printf("peek_rename: %lu %s -> %lu %s\n", parent, name, newparent, newname);
+
+    struct Mount *mount = (struct Mount *)fuse_req_userdata(req);
+
+    struct Node *node;
+    if ((node = nodeget(&mount->nodes, parent)) == NULL)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    // Renaming "[ ] Name" to "[X] Name" or back sets the checkbox to the
+    // new state
+    int checked;
+    int newchecked;
+    char *value = trimcheck((char *)name, &checked);
+    char *newvalue = trimcheck((char *)newname, &newchecked);
+    if (parent != newparent || newchecked == -1 || strcmp(value, newvalue) != 0)
+    {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    int res;
+    char key[BUFFER_SIZE];
+    if ((res = peek_checkkey(&node->info, name, key, BUFFER_SIZE)))
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fuse_reply_err(req, queueput(&_queue, !newchecked, key, node->info.stack[1]) ? ENOMEM : 0);
+}
+
+struct Tags
+{
+    const char *name;
+    char *buf;
+    size_t len;
+    size_t size;
+    size_t last;
+    int found;
+};
+
+static int peek_tagsappend(struct Tags *tags, const char *s, size_t len)
+{
+    if (tags->len + len > tags->size)
+    {
+        size_t size = tags->size ? tags->size * 2 : 256;
+        while (size < tags->len + len)
+            size *= 2;
+
+        char *buf = realloc(tags->buf, size);
+        if (!buf)
+            return -1;
+
+        tags->buf = buf;
+        tags->size = size;
+    }
+
+    memcpy(tags->buf + tags->len, s, len);
+    tags->len += len;
+
+    return 0;
+}
+
+static int peek_tagsadd(struct Tags *tags, const char *attr, const char *value, size_t valuelen)
+{
+    size_t attrlen = strlen(attr) + 1;
+
+    if (!tags->name)
+    {
+        // Listing names, which arrive grouped, so only the last one can
+        // repeat
+        if (tags->found && tags->len - tags->last == attrlen && memcmp(tags->buf + tags->last, attr, attrlen) == 0)
+            return 0;
+
+        tags->last = tags->len;
+        tags->found = 1;
+
+        return peek_tagsappend(tags, attr, attrlen);
+    }
+
+    if (strcmp(attr, tags->name) != 0)
+        return 0;
+
+    // Several values are joined the way the importer splits them
+    if (tags->found && peek_tagsappend(tags, "|", 1))
+        return -1;
+
+    tags->found = 1;
+
+    return peek_tagsappend(tags, value, valuelen);
+}
+
+static int peek_tags(struct PathInfo *info, struct Tags *tags)
+{
+    // Files anywhere, and the file folders in the Manage tree, carry the
+    // favorite and facets of their file
+    char *file;
+    if (info->isfile)
+        file = info->stack[info->stacklen - 1];
+    else if (info->cmd == PEEKCMD_MANAGE && info->stacklen == 2)
+        file = info->stack[1];
+    else
+        return 0;
+
+    struct Database *db;
+    if ((db = peek_db()) == NULL)
+        return -EIO;
+
+    char key[BUFFER_SIZE];
+    char attr[BUFFER_SIZE];
+    int res = 0;
+
+    if (!peek_txnopen(db))
+    {
+        int rc;
+        MDB_cursor *cur;
+        if (!(rc = mdb_cursor_open(db->txn, db->dbrev, &cur)))
+        {
+            MDB_val dbfile = {strlen(file) + 1, file};
+
+            snprintf(key, BUFFER_SIZE, "fav/%s", info->mount->corename);
+            MDB_val dbkey = {strlen(key) + 1, key};
+            if (!mdb_cursor_get(cur, &dbfile, &dbkey, MDB_GET_BOTH))
+                res = peek_tagsadd(tags, "user.peek.fav", "1", 1);
+
+            // Every facet key of the file, in one range read
+            size_t prefixlen = snprintf(key, BUFFER_SIZE, "has/%s/", info->mount->corename);
+            dbkey.mv_size = prefixlen;
+            dbkey.mv_data = key;
+
+            rc = mdb_cursor_get(cur, &dbfile, &dbkey, MDB_GET_BOTH_RANGE);
+            while (!rc && !res)
+            {
+                if (dbkey.mv_size <= prefixlen + 1 || memcmp(dbkey.mv_data, key, prefixlen) != 0)
+                    break;
+
+                char *level = (char *)dbkey.mv_data + prefixlen;
+                size_t restlen = dbkey.mv_size - 1 - prefixlen;
+                char *value = memchr(level, '/', restlen);
+
+                if (value && snprintf(attr, BUFFER_SIZE, "user.peek.has.%.*s", (int)(value - level), level) < BUFFER_SIZE)
+                    res = peek_tagsadd(tags, attr, value + 1, restlen - (value + 1 - level));
+
+                rc = mdb_cursor_get(cur, &dbfile, &dbkey, MDB_NEXT_DUP);
+            }
+
+            mdb_cursor_close(cur);
+        }
+        else
+        {
+            printf("Failed to open cursor: %d\n", rc);
+            res = -EIO;
+        }
+
+        peek_txnclose(db);
+    }
+
+    return res ? -ENOMEM : 0;
+}
+
+static void peek_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+    //printf("peek_getxattr: %lu %s\n", ino, name);
+
+    struct PathInfo *info;
+    if ((info = peek_node(req, ino)) == NULL)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    struct Tags tags;
+    memset(&tags, 0, sizeof(tags));
+    tags.name = name;
+
+    int res;
+    if ((res = peek_tags(info, &tags)))
+        fuse_reply_err(req, -res);
+    else if (!tags.found)
+        fuse_reply_err(req, ENODATA);
+    else if (size == 0)
+        fuse_reply_xattr(req, tags.len);
+    else if (size < tags.len)
+        fuse_reply_err(req, ERANGE);
+    else
+        fuse_reply_buf(req, tags.buf, tags.len);
+
+    free(tags.buf);
+}
+
+static void peek_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    //printf("peek_listxattr: %lu\n", ino);
+
+    struct PathInfo *info;
+    if ((info = peek_node(req, ino)) == NULL)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    struct Tags tags;
+    memset(&tags, 0, sizeof(tags));
+
+    int res;
+    if ((res = peek_tags(info, &tags)))
+        fuse_reply_err(req, -res);
+    else if (size == 0)
+        fuse_reply_xattr(req, tags.len);
+    else if (size < tags.len)
+        fuse_reply_err(req, ERANGE);
+    else
+        fuse_reply_buf(req, tags.buf, tags.len);
+
+    free(tags.buf);
+}
+
+static void peek_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    //printf("peek_readlink: %lu\n", ino);
+
+    struct PathInfo *info;
+    if ((info = peek_node(req, ino)) == NULL)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (!_opts.symlinks || !info->isfile)
+    {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    int res;
+    char target[BUFFER_SIZE];
+    if ((res = peek_linktarget(info, target, BUFFER_SIZE)) < 0)
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fuse_reply_readlink(req, target);
+}
+
+static void peek_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    //printf("peek_opendir: %lu\n", ino);
+
+    struct PathInfo *info;
+    if ((info = peek_node(req, ino)) == NULL)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (info->isfile)
+    {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    // The listing is taken once per open handle, so a listing read in
+    // several calls stays consistent and is never rebuilt part way
+    struct Listing *listing;
+    if ((listing = peek_listing(info)) == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    fi->fh = (uintptr_t)listing;
+
+    if (fuse_reply_open(req, fi))
+        cacherelease(&info->mount->cache, listing);
+}
+
+static void peek_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    //printf("peek_readdir: %lu\n", ino);
+
+    (void) ino;
+
+    struct Listing *listing = (struct Listing *)(uintptr_t)fi->fh;
+    if (!listing)
+    {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+
+    // A short reply is fine, the kernel asks again from where it ended
+    char buf[BUFFER_SIZE];
+    if (size > BUFFER_SIZE)
+        size = BUFFER_SIZE;
+
+    // Offsets 0 and 1 are "." and "..", listing entries follow. Each entry
+    // is passed the offset of the one after it, so the next call resumes
+    // where the buffer filled up.
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+
+    size_t len = 0;
+    off_t total = listing->count + 2;
+    off_t i;
+    for (i = offset; i < total; i++)
+    {
+        const char *name;
+        if (i < 2)
+        {
+            name = (i == 0) ? "." : "..";
+            st.st_ino = 0;
+            st.st_mode = S_IFDIR;
+        }
+        else
+        {
+            name = listingname(listing, i - 2);
+            st.st_ino = listing->entries[i - 2].ino;
+            st.st_mode = listing->entries[i - 2].mode;
+        }
+
+        size_t entlen = fuse_add_direntry(req, buf + len, size - len, name, &st, i + 1);
+        if (entlen > size - len)
+            break;
+
+        len += entlen;
+    }
+
+    fuse_reply_buf(req, buf, len);
+}
+
+static void peek_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    //printf("peek_releasedir: %lu\n", ino);
+
+    (void) ino;
+
+    struct Mount *mount = (struct Mount *)fuse_req_userdata(req);
+
+    struct Listing *listing = (struct Listing *)(uintptr_t)fi->fh;
+    if (listing)
+        cacherelease(&mount->cache, listing);
+
+    fuse_reply_err(req, 0);
+}
+
+// An open file, either a passthrough to the source folder or the text of
+// a stats file taken when it was opened
+struct Handle
+{
+    int fd;
+    pthread_mutex_t lock;
+    off_t next;
+    off_t ahead;
+    size_t window;
+    int streaming;
+    size_t len;
+    char text[];
+};
+
+static void peek_open_stats(fuse_req_t req, struct fuse_file_info *fi)
+{
+    struct Handle *handle;
+    if ((handle = malloc(sizeof(struct Handle) + BUFFER_SIZE)) == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    int len;
+    if ((len = statsprint(&_stats, handle->text, BUFFER_SIZE)) < 0)
+    {
+        free(handle);
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    handle->fd = -1;
+    handle->len = len;
+
+    // Every open is a new snapshot, so nothing may come from the cache
+    fi->fh = (uintptr_t)handle;
+    fi->direct_io = 1;
+
+    if (fuse_reply_open(req, fi))
+        free(handle);
+}
+
+static void peek_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    //printf("peek_open: %lu\n", ino);
+
+    struct PathInfo *info;
+    if ((info = peek_node(req, ino)) == NULL || !info->isfile)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (info->cmd == PEEKCMD_STATS)
+    {
+        peek_open_stats(req, fi);
+        return;
+    }
+
+    int res;
+    char filepath[BUFFER_SIZE];
+    if ((res = peek_filepath(info, filepath)))
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    struct Handle *handle;
+    if ((handle = calloc(1, sizeof(struct Handle))) == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    if ((handle->fd = open(filepath, fi->flags)) == -1)
+    {
+        fuse_reply_err(req, errno);
+        free(handle);
+        return;
+    }
+
+    pthread_mutex_init(&handle->lock, NULL);
+    handle->next = -1;
+
+    // File contents stay in the page cache between opens, the watcher
+    // drops them if the file changes
+    fi->fh = (uintptr_t)handle;
+    fi->keep_cache = 1;
+
+    if (fuse_reply_open(req, fi))
+    {
+        close(handle->fd);
+        pthread_mutex_destroy(&handle->lock);
+        free(handle);
+    }
+}
+
+static void peek_readahead(struct Handle *handle, off_t offset, size_t size)
+{
+    off_t start = 0;
+    size_t len = 0;
+    int advice = -1;
+
+    pthread_mutex_lock(&handle->lock);
+
+    // A read starting where the last one ended is a stream, such as a
+    // core loading a disc image. Several FUSE threads can deliver those
+    // reads a little out of order, so close counts too. Anything else
+    // starts over.
+    if (handle->next >= 0 && offset >= handle->next - PREFETCH_MIN && offset <= handle->next + PREFETCH_MIN)
+    {
+        if (!handle->streaming)
+        {
+            handle->streaming = 1;
+            handle->window = PREFETCH_MIN;
+            handle->ahead = offset;
+            advice = POSIX_FADV_SEQUENTIAL;
+        }
+    }
+    else if (handle->streaming)
+    {
+        handle->streaming = 0;
+        advice = POSIX_FADV_NORMAL;
+    }
+
+    if (!handle->streaming || offset + (off_t)size > handle->next)
+        handle->next = offset + size;
+
+    // Topped up once the reader is halfway into the last window, so the
+    // next one is in the page cache before it gets there
+    if (handle->streaming && handle->next + (off_t)(handle->window / 2) >= handle->ahead)
+    {
+        start = handle->ahead > handle->next ? handle->ahead : handle->next;
+        len = handle->window;
+        handle->ahead = start + len;
+
+        if (handle->window < PREFETCH_MAX)
+            handle->window *= 2;
+    }
+
+    pthread_mutex_unlock(&handle->lock);
+
+    if (advice != -1)
+        posix_fadvise(handle->fd, 0, 0, advice);
+
+    if (len)
+        prefetchput(&_prefetch, handle->fd, start, len);
+}
+
+static void peek_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    //printf("peek_read: %lu\n", ino);
+
+    (void) ino;
+
+    struct Handle *handle = (struct Handle *)(uintptr_t)fi->fh;
+    if (handle->fd == -1)
+    {
+        if ((size_t)offset >= handle->len)
+            offset = size = 0;
+        else if (size > handle->len - offset)
+            size = handle->len - offset;
+
+        fuse_reply_buf(req, handle->text + offset, size);
+        return;
+    }
+
+    peek_readahead(handle, offset, size);
+
+    // Hand libfuse the file descriptor instead of the data, so it can
+    // splice the file pages straight to the device without a copy
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+    src.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    src.buf[0].fd = handle->fd;
+    src.buf[0].pos = offset;
+
+    fuse_reply_data(req, &src, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void peek_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    //printf("peek_release: %lu\n", ino);
+
+    (void) ino;
+
+    struct Handle *handle = (struct Handle *)(uintptr_t)fi->fh;
+    if (handle->fd != -1)
+    {
+        prefetchcancel(&_prefetch, handle->fd);
+        close(handle->fd);
+        pthread_mutex_destroy(&handle->lock);
+    }
+
+    free(handle);
+
+    fuse_reply_err(req, 0);
+}
+
+// Each timed operation runs the handler it wraps, so the time includes
+// sending the reply
+static void peek_timed_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    uint64_t start = statsnow();
+    peek_lookup(req, parent, name);
+    statsadd(&_stats, STATS_LOOKUP, start);
+}
+
+static void peek_timed_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    uint64_t start = statsnow();
+    peek_getattr(req, ino, fi);
+    statsadd(&_stats, STATS_GETATTR, start);
+}
+
+static void peek_timed_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    uint64_t start = statsnow();
+    peek_readlink(req, ino);
+    statsadd(&_stats, STATS_READLINK, start);
+}
+
+static void peek_timed_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    uint64_t start = statsnow();
+    peek_mkdir(req, parent, name, mode);
+    statsadd(&_stats, STATS_MKDIR, start);
+}
+
+static void peek_timed_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    uint64_t start = statsnow();
+    peek_rmdir(req, parent, name);
+    statsadd(&_stats, STATS_RMDIR, start);
+}
+
+static void peek_timed_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname)
+{
+    uint64_t start = statsnow();
+    peek_rename(req, parent, name, newparent, newname);
+    statsadd(&_stats, STATS_RENAME, start);
+}
+
+static void peek_timed_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+    uint64_t start = statsnow();
+    peek_getxattr(req, ino, name, size);
+    statsadd(&_stats, STATS_GETXATTR, start);
+}
+
+static void peek_timed_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    uint64_t start = statsnow();
+    peek_listxattr(req, ino, size);
+    statsadd(&_stats, STATS_LISTXATTR, start);
+}
+
+static void peek_timed_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    uint64_t start = statsnow();
+    peek_opendir(req, ino, fi);
+    statsadd(&_stats, STATS_OPENDIR, start);
+}
+
+static void peek_timed_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    uint64_t start = statsnow();
+    peek_readdir(req, ino, size, offset, fi);
+    statsadd(&_stats, STATS_READDIR, start);
+}
+
+static void peek_timed_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    uint64_t start = statsnow();
+    peek_open(req, ino, fi);
+    statsadd(&_stats, STATS_OPEN, start);
+}
+
+static void peek_timed_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    uint64_t start = statsnow();
+    peek_read(req, ino, size, offset, fi);
+    statsadd(&_stats, STATS_READ, start);
+}
+
+struct fuse_lowlevel_ops peek_oper = {
+	.init		= peek_init,
+	.lookup		= peek_timed_lookup,
+	.forget		= peek_forget,
+	.forget_multi	= peek_forget_multi,
+	.getattr	= peek_timed_getattr,
+	.readlink	= peek_timed_readlink,
+	.mkdir		= peek_timed_mkdir,
+	.rmdir		= peek_timed_rmdir,
+	.rename		= peek_timed_rename,
+	.getxattr	= peek_timed_getxattr,
+	.listxattr	= peek_timed_listxattr,
+	.opendir	= peek_timed_opendir,
+	.readdir	= peek_timed_readdir,
+	.releasedir	= peek_releasedir,
+	.open		= peek_timed_open,
+	.read		= peek_timed_read,
+	.release	= peek_release
+};
+
+struct Change
+{
+    uint64_t ino;
+    uint64_t parent;
+    char *name;
+};
+
+struct Changes
+{
+    struct timespec now;
+    struct Change *items;
+    int count;
+    int size;
+};
+
+static void peek_changeadd(struct Changes *changes, uint64_t ino, uint64_t parent, const char *name)
+{
+    if (changes->count == changes->size)
+    {
+        int size = changes->size ? changes->size * 2 : 64;
+        struct Change *items = realloc(changes->items, size * sizeof(struct Change));
+        if (!items)
+            return;
+
+        changes->items = items;
+        changes->size = size;
+    }
+
+    struct Change *change = &changes->items[changes->count];
+    change->ino = ino;
+    change->parent = parent;
+    change->name = NULL;
+
+    if (name && (change->name = strdup(name)) == NULL)
+        return;
+
+    changes->count++;
+}
+
+static int peek_revalidate_listing(struct PathInfo *info)
+{
+    struct Mount *mount = info->mount;
+
+    size_t txnid;
+    struct timespec mtime;
+    peek_version(mount, &txnid, &mtime);
+
+    // Never listed, or not for a while, so the kernel holds nothing of it
+    // that could be out of date
+    struct Listing *old;
+    if ((old = cachepeek(&mount->cache, info->path)) == NULL)
+        return 0;
+
+    struct Listing *listing;
+    if ((listing = listingnew(info->path, txnid, &mtime)) == NULL)
+    {
+        cacherelease(&mount->cache, old);
+        return 1;
+    }
+
+    peek_readdir_build(info, listing, listingfill);
+    int changed = !listingsame(old, listing);
+
+    cacheput(&mount->cache, listing);
+    cacherelease(&mount->cache, listing);
+    cacherelease(&mount->cache, old);
+
+    return changed;
+}
+
+static void peek_revalidate_node(struct Changes *changes, struct Node *node)
+{
+    struct Mount *mount = node->info.mount;
+
+    // Classified again from scratch, in case a facet key turned from a
+    // file into a folder or went away entirely
+    struct PathInfo info = node->info;
+    int res = 0;
+    if (info.cmd == PEEKCMD_HAS && info.stacklen > 0)
+        res = peek_hasclassify(&info);
+
+    struct stat st;
+    if (info.stacklen > 0 && (res || info.isfile != node->info.isfile || peek_attr(&info, &st)))
+    {
+        peek_changeadd(changes, 0, node->parent, info.stack[info.stacklen - 1]);
+        return;
+    }
+
+    if (info.isfile)
+    {
+        if (st.st_mtim.tv_sec != node->mtime.tv_sec
+            || st.st_mtim.tv_nsec != node->mtime.tv_nsec
+            || st.st_size != node->size)
+        {
+            nodeupdate(&mount->nodes, node->ino, &st.st_mtim, st.st_size);
+            peek_changeadd(changes, node->ino, 0, NULL);
+        }
+
+        return;
+    }
+
+    if (!peek_cacheable(&info))
+        return;
+
+    if (peek_revalidate_listing(&info))
+    {
+        nodeupdate(&mount->nodes, node->ino, &changes->now, 0);
+        peek_changeadd(changes, node->ino, 0, NULL);
+    }
+}
+
+static void peek_revalidate(struct Mount *mount, unsigned int cmds)
+{
+    struct Changes changes;
+    memset(&changes, 0, sizeof(changes));
+    clock_gettime(CLOCK_REALTIME, &changes.now);
+
+    // Checked on copies, since classifying, stat and rebuilding listings
+    // would otherwise hold up every lookup on the mount
+    int count;
+    struct Node **nodes;
+    if ((nodes = nodesnapshot(&mount->nodes, cmds, &count)) == NULL)
+        return;
+
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        peek_revalidate_node(&changes, nodes[i]);
+        free(nodes[i]);
+    }
+
+    free(nodes);
+
+    // The kernel may call back into the mount while being told
+    for (i = 0; i < changes.count; i++)
+    {
+        struct Change *change = &changes.items[i];
+        if (change->name)
+        {
+            fuse_lowlevel_notify_inval_entry(mount->ch, change->parent, change->name, strlen(change->name));
+            free(change->name);
+        }
+        else
+        {
+            fuse_lowlevel_notify_inval_inode(mount->ch, change->ino, 0, 0);
+        }
+    }
+
+    free(changes.items);
+}
+
+static int peek_mountput(struct Mount *mount)
+{
+    // Called with the mounts locked. The watcher may still be checking a
+    // mount that was dropped, so only the last one to let go frees it,
+    // once the mounts are unlocked.
+    return --mount->refs == 0;
+}
+
+static void peek_mountseen(struct Mount *mount)
+{
+    peek_version(mount, &mount->txnid, &mount->srcmtime);
+    mount->gen = romsgen(&mount->roms);
+}
+
+static int peek_changedcmds(void *arg, char *class)
+{
+    unsigned int *cmds = (unsigned int *)arg;
+
+    // The root shows counts and facets, and Manage shows favorites and
+    // facets of every file
+    if (strcmp(class, "fav") == 0)
+        *cmds |= NODE_CMD(PEEKCMD_ROOT) | NODE_CMD(PEEKCMD_FAV) | NODE_CMD(PEEKCMD_MANAGE);
+    else if (strcmp(class, "rec") == 0)
+        *cmds |= NODE_CMD(PEEKCMD_ROOT) | NODE_CMD(PEEKCMD_REC);
+    else if (strcmp(class, "has") == 0)
+        *cmds |= NODE_CMD(PEEKCMD_ROOT) | NODE_CMD(PEEKCMD_HAS) | NODE_CMD(PEEKCMD_MANAGE);
+    else
+        *cmds = NODE_CMDS;
+
+    return 0;
+}
+
+static unsigned int peek_changed(struct Mount *mount, size_t since)
+{
+    // Nothing the core's folders show may have changed, such as when the
+    // service notes a game of another core
+    unsigned int cmds = 0;
+
+    struct Database *db;
+    if ((db = peek_db()) == NULL || peek_txnopen(db))
+        return NODE_CMDS;
+
+    if (dbchanged(db, mount->corename, since, peek_changedcmds, &cmds))
+        cmds = NODE_CMDS;
+
+    peek_txnclose(db);
+
+    return cmds;
+}
+
+struct IndexArgs
+{
+    struct Database *db;
+    struct Mount *mount;
+    char **names;
+    int count;
+    int size;
+    int res;
+};
+
+static int peek_mountindex_add(void *arg, const char *name, const struct stat *st)
+{
+    (void) st;
+
+    struct IndexArgs *args = (struct IndexArgs *)arg;
+
+    if (dbindexed(args->db, args->mount->corename, (char *)name) == 1)
+        return 0;
+
+    if (dbindex(args->db, args->mount->corename, (char *)name, 0))
+        return (args->res = -1);
+
+    return 0;
+}
+
+static int peek_mountindex_stale(void *arg, char *name)
+{
+    struct IndexArgs *args = (struct IndexArgs *)arg;
+
+    struct stat st;
+    if (romslookup(&args->mount->roms, name, &st) != 1)
+        return 0;
+
+    if (args->count == args->size)
+    {
+        int size = args->size ? args->size * 2 : 64;
+        char **names = realloc(args->names, size * sizeof(char *));
+        if (!names)
+            return (args->res = -1);
+
+        args->names = names;
+        args->size = size;
+    }
+
+    if ((args->names[args->count] = strdup(name)) == NULL)
+        return (args->res = -1);
+
+    args->count++;
+
+    return 0;
+}
+
+static void peek_mountindex(struct Mount *mount)
+{
+    // Only possible while the snapshot is current, since it is the list
+    // of names the index is brought in line with
+    struct Database *db;
+    if ((db = peek_db()) == NULL)
+        return;
+
+    if (dbtxnopen(db, 0))
+        return;
+
+    struct IndexArgs args;
+    memset(&args, 0, sizeof(args));
+    args.db = db;
+    args.mount = mount;
+
+    if (romseach(&mount->roms, peek_mountindex_add, &args))
+    {
+        dbtxnclose(db);
+        return;
+    }
+
+    // Stale names are collected first, since removing them moves the
+    // cursor that finds them
+    if (!args.res)
+        dbindexeach(db, mount->corename, peek_mountindex_stale, &args);
+
+    int i;
+    for (i = 0; i < args.count; i++)
+    {
+        if (!args.res && dbindex(db, mount->corename, args.names[i], 1))
+            args.res = -1;
+
+        free(args.names[i]);
+    }
+
+    free(args.names);
+
+    if (dbtxnclose(db) || args.res)
+    {
+        printf("Failed to update search index for %s\n", mount->corename);
+        return;
+    }
+
+    mount->indexed = 1;
+}
+
+static void peek_mountcheck(struct Mount *mount)
+{
+    size_t txnid = mount->txnid;
+    struct timespec srcmtime = mount->srcmtime;
+    unsigned int gen = mount->gen;
+
+    // Done before the version is read, so the index is part of what the
+    // listings are checked against rather than a change of its own
+    if (!mount->indexed || romsgen(&mount->roms) != gen)
+        peek_mountindex(mount);
+
+    peek_mountseen(mount);
+
+    // Files coming or going shows anywhere, a database change only in the
+    // folders of what it wrote
+    unsigned int cmds = 0;
+    if (mount->gen != gen
+        || mount->srcmtime.tv_sec != srcmtime.tv_sec
+        || mount->srcmtime.tv_nsec != srcmtime.tv_nsec)
+        cmds = NODE_CMDS;
+    else if (mount->txnid != txnid)
+        cmds = peek_changed(mount, txnid);
+
+    if (cmds)
+        peek_revalidate(mount, cmds);
+}
+
+static void *peek_watch(void *arg)
+{
+    (void) arg;
+
+    // Every write to the database touches its data file, so a change
+    // wakes the watcher right away instead of on the next tick
+    int fd;
+    if ((fd = inotify_init()) >= 0 && inotify_add_watch(fd, dbpath(), IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE) < 0)
+    {
+        printf("Failed to watch database: %s\n", strerror(errno));
+        close(fd);
+        fd = -1;
+    }
+
+    char buf[EVENT_BUFFER_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (!_terminated)
+    {
+        // Source folders are only noticed on the tick, through the
+        // generation their watch keeps
+        if (poll(&pfd, 1, 1000) > 0 && read(fd, buf, EVENT_BUFFER_SIZE) < 0)
+            break;
+
+        // Held just long enough to take a reference on each mount, so a
+        // core switch doesn't wait for the checks
+        struct Mount *mounts[MOUNT_MAX];
+        int count = 0;
+
+        pthread_mutex_lock(&_mountslock);
+
+        int i;
+        for (i = 0; i < MOUNT_MAX; i++)
+        {
+            if (_mounts[i] && !_mounts[i]->exited)
+            {
+                _mounts[i]->refs++;
+                mounts[count++] = _mounts[i];
+            }
+        }
+
+        pthread_mutex_unlock(&_mountslock);
+
+        for (i = 0; i < count; i++)
+            peek_mountcheck(mounts[i]);
+
+        pthread_mutex_lock(&_mountslock);
+
+        int dropped = 0;
+        for (i = 0; i < count; i++)
+        {
+            if (peek_mountput(mounts[i]))
+                mounts[dropped++] = mounts[i];
+        }
+
+        pthread_mutex_unlock(&_mountslock);
+
+        for (i = 0; i < dropped; i++)
+            mountfree(mounts[i]);
+    }
+
+    if (fd >= 0)
+        close(fd);
+
+    return NULL;
+}
+
+static int peek_flush(void *arg, struct QueueItem *items)
+{
+    (void) arg;
+
+    struct Database *db;
+    if ((db = peek_db()) == NULL)
+        return -1;
+
+    if (dbtxnopen(db, 0))
+        return -1;
+
+    int res = 0;
+    for (; items; items = items->next)
+    {
+        if (items->del ? dbdel(db, items->key, items->data) : dbput(db, items->key, items->data))
+            res = -1;
+    }
+
+    if (dbtxnclose(db))
+        res = -1;
+
+    return res;
+}
+
+int peekinit(void)
+{
+    if (dbopen(&_db))
+        return -1;
+
+    if (pthread_key_create(&_dbkey, peek_dbfree))
+    {
+        printf("Failed to create database key\n");
+        return -1;
+    }
+
+    if (queueopen(&_queue, peek_flush, NULL))
+        return -1;
+
+    if (prefetchopen(&_prefetch))
+        return -1;
+
+    statsinit(&_stats);
+
+    return 0;
+}
+
+void peekcleanup(void)
+{
+    int i;
+    for (i = 0; i < MOUNT_MAX; i++)
+    {
+        if (_mounts[i])
+        {
+            mountfree(_mounts[i]);
+            _mounts[i] = NULL;
+        }
+    }
+
+    queueclose(&_queue);
+    prefetchclose(&_prefetch);
+
+    struct Database *db;
+    if ((db = pthread_getspecific(_dbkey)))
+    {
+        pthread_setspecific(_dbkey, NULL);
+        peek_dbfree(db);
+    }
+
+    dbclose(&_db);
+}
+
+struct Database *peekdb(void)
+{
+    return &_db;
+}
+
+int peekattach(struct Mount *mount)
+{
+    // The mount is never attached to the kernel, only its folder snapshot
+    // is started, and the search index is filled in like the watcher would
+    _mounts[0] = mount;
+
+    if (romsopen(&mount->roms, mount->srcpath))
+        return -1;
+
+    peek_mountindex(mount);
+    peek_mountseen(mount);
+
+    return 0;
+}
+
+int peekstats(char *buf, size_t size)
+{
+    return statsprint(&_stats, buf, size);
+}
+
+static void peek_signal(int sig)
+{
+    (void) sig;
+
+    _terminated = 1;
+}
+
+static int peek_mountfind(char *mountpath)
+{
+    int i;
+    for (i = 0; i < MOUNT_MAX; i++)
+    {
+        if (_mounts[i] && strcmp(_mounts[i]->mountpath, mountpath) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static int peek_mountslot(void)
+{
+    // Make room by dropping the folder that was switched to longest ago
+    int oldest = 0;
+    int i;
+    for (i = 0; i < MOUNT_MAX; i++)
+    {
+        if (!_mounts[i])
+            return i;
+
+        if (_mounts[i]->used < _mounts[oldest]->used)
+            oldest = i;
+    }
+
+    return oldest;
+}
+
+// A folder dropped to make room is handed back rather than freed, since
+// that waits for its loop to finish
+static struct Mount *peek_mountadd(char *mountpath, struct Mount **evicted)
+{
+    int slot = peek_mountslot();
+
+    struct Mount *mount;
+    if ((mount = mountnew(mountpath)) == NULL)
+        return NULL;
+
+    // Mounting may consume options, so each mount gets its own copy
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    int i;
+    for (i = 0; i < _args.argc; i++)
+    {
+        if (fuse_opt_add_arg(&args, _args.argv[i]) == -1)
+        {
+            fuse_opt_free_args(&args);
+            mountfree(mount);
+            return NULL;
+        }
+    }
+
+    int res = mountattach(mount, &args, &peek_oper, sizeof(peek_oper), _multithreaded);
+    fuse_opt_free_args(&args);
+
+    if (res)
+    {
+        mountfree(mount);
+        return NULL;
+    }
+
+    *evicted = _mounts[slot];
+    _mounts[slot] = mount;
+
+    return mount;
+}
+
+static int peek_mount_request(char *mountpath, struct Mount **evicted)
+{
+    int i;
+    if ((i = peek_mountfind(mountpath)) >= 0)
+    {
+        // Switching back to a core keeps everything the mount built up,
+        // unless the folder was unmounted from outside in the meantime
+        if (!_mounts[i]->exited)
+        {
+            printf("Already mounted: %s\n", mountpath);
+            _mounts[i]->used = time(NULL);
+            return 0;
+        }
+
+        // Its loop is already done, so freeing it here doesn't wait
+        if (peek_mountput(_mounts[i]))
+            mountfree(_mounts[i]);
+
+        _mounts[i] = NULL;
+    }
+
+    struct Mount *mount;
+    if ((mount = peek_mountadd(mountpath, evicted)) == NULL)
+        return -1;
+
+    if (mountstart(mount))
+    {
+        _mounts[peek_mountfind(mountpath)] = NULL;
+        mountfree(mount);
+        return -1;
+    }
+
+    peek_mountseen(mount);
+
+    return 0;
+}
+
+static int peek_unmount_request(char *mountpath, struct Mount **removed)
+{
+    int i;
+    if ((i = peek_mountfind(mountpath)) < 0)
+    {
+        printf("Not mounted: %s\n", mountpath);
+        return -1;
+    }
+
+    *removed = _mounts[i];
+    _mounts[i] = NULL;
+
+    // Nothing is left to serve, so the daemon goes away as on --stop
+    for (i = 0; i < MOUNT_MAX && !_mounts[i]; i++);
+    if (i == MOUNT_MAX)
+        _terminated = 1;
+
+    return 0;
+}
+
+static int peek_readline(int fd, char *buf, size_t size)
+{
+    size_t len = 0;
+    while (len < size - 1)
+    {
+        ssize_t readlen = read(fd, buf + len, 1);
+        if (readlen < 0 && errno == EINTR)
+            continue;
+
+        if (readlen <= 0)
+            return -1;
+
+        if (buf[len] == '\n')
+            break;
+
+        len++;
+    }
+
+    buf[len] = '\0';
+
+    return 0;
+}
+
+static void peek_command(int fd)
+{
+    char buf[BUFFER_SIZE];
+    if (peek_readline(fd, buf, BUFFER_SIZE))
+        return;
+
+    int res = -1;
+    struct Mount *removed = NULL;
+    if (strncmp(buf, "mount ", 6) == 0)
+    {
+        pthread_mutex_lock(&_mountslock);
+        res = peek_mount_request(buf + 6, &removed);
+        if (removed && !peek_mountput(removed))
+            removed = NULL;
+        pthread_mutex_unlock(&_mountslock);
+    }
+    else if (strncmp(buf, "unmount ", 8) == 0)
+    {
+        pthread_mutex_lock(&_mountslock);
+        res = peek_unmount_request(buf + 8, &removed);
+        if (removed && !peek_mountput(removed))
+            removed = NULL;
+        pthread_mutex_unlock(&_mountslock);
+    }
+    else if (strcmp(buf, "stop") == 0)
+    {
+        _terminated = 1;
+        res = 0;
+    }
+    else
+    {
+        printf("Unknown command: %s\n", buf);
+    }
+
+    const char *reply = res ? "fail\n" : "ok\n";
+    if (write(fd, reply, strlen(reply)) < 0)
+        printf("Failed to reply to command: %s\n", strerror(errno));
+
+    // Taking a folder down waits for its loop to finish, which the client
+    // doesn't have to
+    if (removed)
+        mountfree(removed);
+}
+
+static int peek_client(const char *cmd)
+{
+    int fd;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, SOCKET_PATH);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    char buf[BUFFER_SIZE];
+    int len = snprintf(buf, BUFFER_SIZE, "%s\n", cmd);
+    if (len >= BUFFER_SIZE || write(fd, buf, len) != len || peek_readline(fd, buf, BUFFER_SIZE))
+    {
+        printf("Failed to send command to running daemon\n");
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+
+    return strcmp(buf, "ok") == 0 ? 0 : 1;
+}
+
+static int peek_listen(void)
+{
+    int fd;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        printf("Failed to create command socket\n");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, SOCKET_PATH);
+
+    // Held from the check until listening, so two daemons starting at
+    // once can't both take the socket
+    int lock;
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    if ((lock = open(SOCKET_LOCK_PATH, O_RDWR | O_CREAT, 0666)) < 0 || fcntl(lock, F_SETLKW, &fl) < 0)
+    {
+        printf("Failed to lock command socket: %s\n", strerror(errno));
+        if (lock >= 0)
+            close(lock);
+        close(fd);
+        return -1;
+    }
+
+    // Checked again under the lock, as another daemon may have started
+    // since this one found nothing there
+    int probe;
+    int live = 0;
+    if ((probe = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0)
+    {
+        live = connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(probe);
+    }
+
+    int res = 0;
+    if (live)
+    {
+        printf("Another daemon is already running\n");
+        res = -1;
+    }
+    else
+    {
+        // Nothing answered on the socket, so whatever is left there is stale
+        unlink(SOCKET_PATH);
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0)
+        {
+            printf("Failed to listen on command socket: %s\n", strerror(errno));
+            res = -1;
+        }
+    }
+
+    // Closing the file drops the lock
+    close(lock);
+
+    if (res)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void peek_serve(int sock)
+{
+    struct pollfd pfd = { sock, POLLIN, 0 };
+
+    // Polled with a timeout, since signals may land on any of the mount
+    // threads rather than this one
+    while (!_terminated)
+    {
+        int res = poll(&pfd, 1, 1000);
+        if (res <= 0)
+            continue;
+
+        int fd;
+        if ((fd = accept(sock, NULL, NULL)) < 0)
+            continue;
+
+        peek_command(fd);
+        close(fd);
+    }
+}
+
+static int peek_daemon(char *mountpoint, int foreground)
+{
+    int sock;
+    if ((sock = peek_listen()) < 0)
+        return 1;
+
+    umask(0);
+
+    // The first mount is made before detaching, so whoever started the
+    // daemon still learns whether it worked
+    // Nothing is mounted yet, so nothing can be evicted
+    struct Mount *mount;
+    struct Mount *evicted;
+    if ((mount = peek_mountadd(mountpoint, &evicted)) == NULL)
+    {
+        close(sock);
+        unlink(SOCKET_PATH);
+        return 1;
+    }
+
+    fuse_daemonize(foreground);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = peek_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // LMDB handles must not cross a fork, so the database is opened by the
+    // detached process
+    int err = 0;
+    pthread_t watcher;
+    int watching = 0;
+    if (peekinit() || mountstart(mount))
+    {
+        err = 1;
+    }
+    else
+    {
+        peek_mountseen(mount);
+
+        // Tells the kernel when cached entries go stale, so they can be
+        // kept for much longer than the timeout alone would allow
+        if (pthread_create(&watcher, NULL, peek_watch, NULL) == 0)
+            watching = 1;
+        else
+            printf("Failed to start watcher thread\n");
+
+        peek_serve(sock);
+    }
+
+    printf("\n");
+    printf("Cleaning up!\n");
+
+    close(sock);
+    unlink(SOCKET_PATH);
+
+    _terminated = 1;
+    if (watching)
+        pthread_join(watcher, NULL);
+
+    peekcleanup();
+
+    return err;
+}
+
+int peekmain(int argc, char *argv[])
+{
+    printf("Starting up...\n");
+
+    _args = (struct fuse_args)FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&_args, &_opts, peek_opts, NULL) == -1)
+    {
+        printf("Failed to parse options\n");
+        return 1;
+    }
+
+    char *mountpoint = NULL;
+    int foreground = 0;
+    if (fuse_parse_cmdline(&_args, &mountpoint, &_multithreaded, &foreground) == -1)
+    {
+        printf("Failed to parse command line\n");
+        fuse_opt_free_args(&_args);
+        return 1;
+    }
+
+    int err;
+    if (_opts.stop)
+    {
+        // Stopping unmounts every folder the daemon is serving
+        err = peek_client("stop") > 0;
+    }
+    else if (!mountpoint)
+    {
+        printf("Missing mount path\n");
+        err = 1;
+    }
+    else if (_opts.unmount)
+    {
+        char cmd[BUFFER_SIZE];
+        snprintf(cmd, BUFFER_SIZE, "unmount %s", mountpoint);
+
+        // Only the daemon can take its folders down
+        err = peek_client(cmd) != 0;
+    }
+    else
+    {
+        char cmd[BUFFER_SIZE];
+        snprintf(cmd, BUFFER_SIZE, "mount %s", mountpoint);
+
+        // A daemon that's already running serves the new folder itself,
+        // otherwise this process becomes that daemon
+        if ((err = peek_client(cmd)) < 0)
+        {
+            if (_opts.symlinks)
+                printf("Presenting filtered files as symlinks\n");
+
+            err = peek_daemon(mountpoint, foreground);
+        }
+    }
 
-    cleanup();
+    free(mountpoint);
+    fuse_opt_free_args(&_args);
 
     printf("All done!\n");
 
@@ -0,0 +1,189 @@
+#define FUSE_USE_VERSION 26
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <path.h>
+#include <cache.h>
+#include <roms.h>
+#include <node.h>
+#include "mount.h"
+
+static void mountwake(int sig)
+{
+    (void) sig;
+}
+
+static void *mountthread(void *arg)
+{
+    struct Mount *mount = (struct Mount *)arg;
+
+    if (mount->multithreaded)
+        fuse_session_loop_mt(mount->se);
+    else
+        fuse_session_loop(mount->se);
+
+    // The loop also ends when the folder is unmounted from outside
+    mount->exited = 1;
+
+    return NULL;
+}
+
+struct Mount *mountnew(char *mountpath)
+{
+    struct Mount *mount;
+    if ((mount = calloc(1, sizeof(struct Mount))) == NULL)
+    {
+        printf("Failed to allocate mount\n");
+        return NULL;
+    }
+
+    // Held by its slot in the daemon, and by the watcher while it checks
+    mount->refs = 1;
+
+    if (cacheinit(&mount->cache))
+    {
+        free(mount);
+        return NULL;
+    }
+
+    if (nodesinit(&mount->nodes, mount))
+    {
+        cacheclose(&mount->cache);
+        free(mount);
+        return NULL;
+    }
+
+    if ((mount->mountpath = strdup(mountpath)) == NULL)
+    {
+        mountfree(mount);
+        return NULL;
+    }
+
+    printf("Mount path: %s\n", mount->mountpath);
+
+    if ((mount->srcpath = pathup(mount->mountpath)) == NULL)
+    {
+        printf("Failed to get source path\n");
+        mountfree(mount);
+        return NULL;
+    }
+
+    printf("Source path: %s\n", mount->srcpath);
+
+    if ((mount->corename = pathfile(mount->srcpath)) == NULL)
+    {
+        printf("Failed to get core name\n");
+        mountfree(mount);
+        return NULL;
+    }
+
+    printf("Core name: %s\n", mount->corename);
+
+    mount->used = time(NULL);
+
+    return mount;
+}
+
+int mountattach(struct Mount *mount, struct fuse_args *args, const struct fuse_lowlevel_ops *op, size_t op_size, int multithreaded)
+{
+    if ((mount->ch = fuse_mount(mount->mountpath, args)) == NULL)
+    {
+        printf("Failed to mount: %s\n", mount->mountpath);
+        return -1;
+    }
+
+    // The mount is handed to every request as its user data
+    if ((mount->se = fuse_lowlevel_new(args, op, op_size, mount)) == NULL)
+    {
+        printf("Failed to create filesystem: %s\n", mount->mountpath);
+        fuse_unmount(mount->mountpath, mount->ch);
+        mount->ch = NULL;
+        return -1;
+    }
+
+    fuse_session_add_chan(mount->se, mount->ch);
+
+    mount->multithreaded = multithreaded;
+
+    return 0;
+}
+
+int mountstart(struct Mount *mount)
+{
+    if (romsopen(&mount->roms, mount->srcpath))
+    {
+        printf("Failed to open source path\n");
+        return -1;
+    }
+
+    // Stopping a loop takes a signal to break its wait, and the signal
+    // must not restart the wait
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = mountwake;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if (pthread_create(&mount->thread, NULL, mountthread, mount))
+    {
+        printf("Failed to start mount thread\n");
+        romsclose(&mount->roms);
+        return -1;
+    }
+
+    mount->started = 1;
+
+    return 0;
+}
+
+void mountfree(struct Mount *mount)
+{
+    if (mount->se)
+        fuse_session_exit(mount->se);
+
+    if (mount->started)
+    {
+        // The loop only checks for exit between requests, so keep waking
+        // it until it notices
+        while (!mount->exited)
+        {
+            pthread_kill(mount->thread, SIGUSR1);
+            usleep(10000);
+        }
+
+        pthread_join(mount->thread, NULL);
+        romsclose(&mount->roms);
+    }
+
+    if (mount->se)
+    {
+        fuse_session_remove_chan(mount->ch);
+        fuse_session_destroy(mount->se);
+    }
+
+    // Unmounting also frees the channel
+    if (mount->ch)
+    {
+        printf("Unmounting: %s\n", mount->mountpath);
+        fuse_unmount(mount->mountpath, mount->ch);
+    }
+
+    nodesclose(&mount->nodes);
+    cacheclose(&mount->cache);
+
+    if (mount->corename && *mount->corename)
+        free(mount->corename);
+
+    if (mount->srcpath && strcmp(mount->srcpath, "/") != 0)
+        free(mount->srcpath);
+
+    free(mount->mountpath);
+    free(mount);
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#include <pthread.h>
+#include <time.h>
+
+#define MOUNT_MAX 8
+
+struct fuse_session;
+struct fuse_chan;
+struct fuse_args;
+struct fuse_lowlevel_ops;
+
+// Everything that belongs to one Peek folder, so a single daemon can
+// serve the folder of every core and keep its state between switches
+struct Mount
+{
+    char *mountpath;
+    char *srcpath;
+    char *corename;
+    struct Cache cache;
+    struct Roms roms;
+    struct Nodes nodes;
+    struct fuse_chan *ch;
+    struct fuse_session *se;
+    int multithreaded;
+    pthread_t thread;
+    int started;
+    volatile int exited;
+    time_t used;
+    size_t txnid;
+    unsigned int gen;
+    struct timespec srcmtime;
+    int refs;
+    int indexed;
+};
+
+struct Mount *mountnew(char *mountpath);
+int mountattach(struct Mount *mount, struct fuse_args *args, const struct fuse_lowlevel_ops *op, size_t op_size, int multithreaded);
+int mountstart(struct Mount *mount);
+void mountfree(struct Mount *mount);
\ No newline at end of file
@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "node.h"
+
+static unsigned int nodehash(uint64_t parent, const char *name)
+{
+    // FNV-1a over the parent inode, then the name
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < 8; i++)
+    {
+        hash ^= (unsigned char)(parent >> (i * 8));
+        hash *= 16777619u;
+    }
+
+    for (; *name; name++)
+    {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static char *nodename(struct Node *node)
+{
+    return node->info.stack[node->info.stacklen - 1];
+}
+
+static void nodelink(struct Node *node, struct Node **byname, struct Node **byino, unsigned int bucketslen)
+{
+    unsigned int bucket = node->ino % bucketslen;
+    node->inonext = byino[bucket];
+    byino[bucket] = node;
+
+    // The root has no name, so it is only found by inode, as is a node
+    // replaced by a newer one for the same name
+    if (node->info.stacklen > 0 && !node->stale)
+    {
+        bucket = nodehash(node->parent, nodename(node)) % bucketslen;
+        node->next = byname[bucket];
+        byname[bucket] = node;
+    }
+}
+
+static void nodegrow(struct Nodes *nodes)
+{
+    unsigned int bucketslen = nodes->bucketslen * 2;
+    struct Node **byname = calloc(bucketslen, sizeof(struct Node *));
+    struct Node **byino = calloc(bucketslen, sizeof(struct Node *));
+    if (!byname || !byino)
+    {
+        free(byname);
+        free(byino);
+        return;
+    }
+
+    unsigned int i;
+    for (i = 0; i < nodes->bucketslen; i++)
+    {
+        struct Node *node = nodes->byino[i];
+        while (node)
+        {
+            struct Node *next = node->inonext;
+            nodelink(node, byname, byino, bucketslen);
+            node = next;
+        }
+    }
+
+    free(nodes->byname);
+    free(nodes->byino);
+    nodes->byname = byname;
+    nodes->byino = byino;
+    nodes->bucketslen = bucketslen;
+}
+
+static struct Node *nodefind(struct Nodes *nodes, uint64_t parent, const char *name)
+{
+    struct Node *node;
+    for (node = nodes->byname[nodehash(parent, name) % nodes->bucketslen]; node; node = node->next)
+    {
+        if (node->parent == parent && strcmp(nodename(node), name) == 0)
+            return node;
+    }
+
+    return NULL;
+}
+
+static void nodeunname(struct Nodes *nodes, struct Node *node)
+{
+    struct Node **link = &nodes->byname[nodehash(node->parent, nodename(node)) % nodes->bucketslen];
+    while (*link && *link != node)
+        link = &(*link)->next;
+
+    if (*link)
+        *link = node->next;
+}
+
+static struct Node *nodefindino(struct Nodes *nodes, uint64_t ino)
+{
+    struct Node *node;
+    for (node = nodes->byino[ino % nodes->bucketslen]; node; node = node->inonext)
+    {
+        if (node->ino == ino)
+            return node;
+    }
+
+    return NULL;
+}
+
+static struct Node *nodenew(uint64_t ino, uint64_t parent, struct PathInfo *info)
+{
+    size_t len = 1;
+    int i;
+    for (i = 0; i < info->stacklen; i++)
+        len += strlen(info->stack[i]) + 1;
+
+    // One copy of the path joined with slashes, one split into components
+    struct Node *node;
+    if ((node = malloc(sizeof(struct Node) + len * 2)) == NULL)
+        return NULL;
+
+    node->next = NULL;
+    node->inonext = NULL;
+    node->ino = ino;
+    node->parent = parent;
+    node->nlookup = 0;
+    node->stale = 0;
+    node->mtime.tv_sec = 0;
+    node->mtime.tv_nsec = 0;
+    node->size = 0;
+    node->info = *info;
+    node->info.path = node->buf;
+
+    char *path = node->buf;
+    char *names = node->buf + len;
+    for (i = 0; i < info->stacklen; i++)
+    {
+        size_t namelen = strlen(info->stack[i]);
+
+        if (i > 0)
+            *path++ = '/';
+
+        memcpy(path, info->stack[i], namelen);
+        path += namelen;
+
+        memcpy(names, info->stack[i], namelen + 1);
+        node->info.stack[i] = names;
+        names += namelen + 1;
+    }
+
+    *path = '\0';
+
+    return node;
+}
+
+int nodesinit(struct Nodes *nodes, struct Mount *mount)
+{
+    memset(nodes, 0, sizeof(struct Nodes));
+
+    if (pthread_mutex_init(&nodes->lock, NULL))
+    {
+        printf("Failed to create node lock\n");
+        return -1;
+    }
+
+    nodes->byname = calloc(NODE_BUCKETS, sizeof(struct Node *));
+    nodes->byino = calloc(NODE_BUCKETS, sizeof(struct Node *));
+    if (!nodes->byname || !nodes->byino)
+    {
+        printf("Failed to allocate node table\n");
+        nodesclose(nodes);
+        return -1;
+    }
+
+    nodes->bucketslen = NODE_BUCKETS;
+
+    struct PathInfo info;
+    memset(&info, 0, sizeof(info));
+    info.mount = mount;
+    info.cmd = PEEKCMD_ROOT;
+
+    // FUSE always knows the root as inode 1
+    if ((nodes->root = nodenew(1, 0, &info)) == NULL)
+    {
+        printf("Failed to allocate root node\n");
+        nodesclose(nodes);
+        return -1;
+    }
+
+    nodelink(nodes->root, nodes->byname, nodes->byino, nodes->bucketslen);
+    nodes->count = 1;
+    nodes->nextino = 2;
+
+    return 0;
+}
+
+void nodesclose(struct Nodes *nodes)
+{
+    if (nodes->byino)
+    {
+        unsigned int i;
+        for (i = 0; i < nodes->bucketslen; i++)
+        {
+            struct Node *node = nodes->byino[i];
+            while (node)
+            {
+                struct Node *next = node->inonext;
+                free(node);
+                node = next;
+            }
+        }
+    }
+
+    free(nodes->byname);
+    free(nodes->byino);
+    nodes->byname = NULL;
+    nodes->byino = NULL;
+    nodes->root = NULL;
+
+    pthread_mutex_destroy(&nodes->lock);
+}
+
+struct Node *nodeget(struct Nodes *nodes, uint64_t ino)
+{
+    if (ino == 1)
+        return nodes->root;
+
+    pthread_mutex_lock(&nodes->lock);
+    struct Node *node = nodefindino(nodes, ino);
+    pthread_mutex_unlock(&nodes->lock);
+
+    return node;
+}
+
+struct Node *nodeadd(struct Nodes *nodes, struct Node *parent, struct PathInfo *info)
+{
+    const char *name = info->stack[info->stacklen - 1];
+
+    pthread_mutex_lock(&nodes->lock);
+
+    // A name that now stands for something else, like a facet value that
+    // became a folder, gets a new node, since the kernel can't see an inode
+    // change type. The old one is kept until the kernel forgets it.
+    struct Node *node;
+    if ((node = nodefind(nodes, parent->ino, name)) && (node->info.cmd != info->cmd || node->info.isfile != info->isfile))
+    {
+        nodeunname(nodes, node);
+        node->stale = 1;
+        node = NULL;
+    }
+
+    if (node == NULL)
+    {
+        if ((node = nodenew(nodes->nextino, parent->ino, info)))
+        {
+            // Numbers are never handed out twice, so the kernel can't
+            // mistake a new node for one it has forgotten
+            nodes->nextino++;
+            nodelink(node, nodes->byname, nodes->byino, nodes->bucketslen);
+
+            if (++nodes->count > nodes->bucketslen)
+                nodegrow(nodes);
+        }
+    }
+
+    if (node)
+        node->nlookup++;
+
+    pthread_mutex_unlock(&nodes->lock);
+
+    return node;
+}
+
+void nodeforget(struct Nodes *nodes, uint64_t ino, uint64_t nlookup)
+{
+    if (ino == 1)
+        return;
+
+    pthread_mutex_lock(&nodes->lock);
+
+    struct Node **link = &nodes->byino[ino % nodes->bucketslen];
+    while (*link)
+    {
+        struct Node *node = *link;
+        if (node->ino == ino)
+        {
+            node->nlookup = (node->nlookup > nlookup) ? node->nlookup - nlookup : 0;
+            if (node->nlookup == 0)
+            {
+                *link = node->inonext;
+                nodeunname(nodes, node);
+
+                free(node);
+                nodes->count--;
+            }
+
+            break;
+        }
+
+        link = &node->inonext;
+    }
+
+    pthread_mutex_unlock(&nodes->lock);
+}
+
+void nodeattr(struct Nodes *nodes, struct Node *node, struct stat *st)
+{
+    pthread_mutex_lock(&nodes->lock);
+
+    if (S_ISDIR(st->st_mode))
+    {
+        // Folders only exist in the mount, so their times are when the
+        // kernel first saw them, or when their listing last changed
+        if (node->mtime.tv_sec == 0)
+            clock_gettime(CLOCK_REALTIME, &node->mtime);
+
+        st->st_mtim = node->mtime;
+        st->st_ctim = node->mtime;
+    }
+    else
+    {
+        // Remembered, so a later change to the file can be told apart
+        node->mtime = st->st_mtim;
+        node->size = st->st_size;
+    }
+
+    pthread_mutex_unlock(&nodes->lock);
+}
+
+void nodeupdate(struct Nodes *nodes, uint64_t ino, struct timespec *mtime, off_t size)
+{
+    pthread_mutex_lock(&nodes->lock);
+
+    struct Node *node;
+    if ((node = nodefindino(nodes, ino)) != NULL)
+    {
+        node->mtime = *mtime;
+        node->size = size;
+    }
+
+    pthread_mutex_unlock(&nodes->lock);
+}
+
+struct Node **nodesnapshot(struct Nodes *nodes, unsigned int cmds, int *count)
+{
+    // Copies of the nodes for the commands in cmds, so slow work on them
+    // doesn't hold up lookups. Each copy and the array are freed by the
+    // caller.
+    pthread_mutex_lock(&nodes->lock);
+
+    struct Node **copies;
+    if ((copies = malloc(nodes->count * sizeof(struct Node *))) == NULL)
+    {
+        pthread_mutex_unlock(&nodes->lock);
+        return NULL;
+    }
+
+    *count = 0;
+
+    unsigned int i;
+    for (i = 0; i < nodes->bucketslen; i++)
+    {
+        struct Node *node;
+        for (node = nodes->byino[i]; node; node = node->inonext)
+        {
+            if (!(cmds & NODE_CMD(node->info.cmd)))
+                continue;
+
+            struct Node *copy;
+            if ((copy = nodenew(node->ino, node->parent, &node->info)) == NULL)
+                continue;
+
+            copy->mtime = node->mtime;
+            copy->size = node->size;
+            copies[(*count)++] = copy;
+        }
+    }
+
+    pthread_mutex_unlock(&nodes->lock);
+
+    return copies;
+}
\ No newline at end of file
@@ -0,0 +1,73 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define NODE_DEPTH 20
+#define NODE_BUCKETS 1024
+
+enum peekcmd
+{
+    PEEKCMD_ROOT,
+    PEEKCMD_FAV,
+    PEEKCMD_REC,
+    PEEKCMD_ALPHA,
+    PEEKCMD_HAS,
+    PEEKCMD_MANAGE,
+    PEEKCMD_SEARCH,
+    PEEKCMD_STATS
+};
+
+// Commands as bits, for picking out the nodes of some of them
+#define NODE_CMD(cmd) (1u << (cmd))
+#define NODE_CMDS (~0u)
+
+struct Mount;
+
+// A path in the mount, already split into its components and classified
+struct PathInfo
+{
+    struct Mount *mount;
+    char *path;
+    char *stack[NODE_DEPTH];
+    int stacklen;
+    enum peekcmd cmd;
+    int isfile;
+};
+
+// Every path the kernel has looked up gets a node, which keeps its inode
+// number for as long as the kernel remembers it
+struct Node
+{
+    struct Node *next;
+    struct Node *inonext;
+    uint64_t ino;
+    uint64_t parent;
+    uint64_t nlookup;
+    int stale;
+    struct timespec mtime;
+    off_t size;
+    struct PathInfo info;
+    char buf[];
+};
+
+struct Nodes
+{
+    pthread_mutex_t lock;
+    struct Node **byname;
+    struct Node **byino;
+    unsigned int bucketslen;
+    unsigned int count;
+    uint64_t nextino;
+    struct Node *root;
+};
+
+int nodesinit(struct Nodes *nodes, struct Mount *mount);
+void nodesclose(struct Nodes *nodes);
+struct Node *nodeget(struct Nodes *nodes, uint64_t ino);
+struct Node *nodeadd(struct Nodes *nodes, struct Node *parent, struct PathInfo *info);
+void nodeforget(struct Nodes *nodes, uint64_t ino, uint64_t nlookup);
+void nodeattr(struct Nodes *nodes, struct Node *node, struct stat *st);
+void nodeupdate(struct Nodes *nodes, uint64_t ino, struct timespec *mtime, off_t size);
+struct Node **nodesnapshot(struct Nodes *nodes, unsigned int cmds, int *count);
\ No newline at end of file
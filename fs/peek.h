@@ -0,0 +1,18 @@
+#include <stddef.h>
+
+// The handlers and setup of peekfs, for tools that call them in-process
+// instead of through the kernel, such as fsbench. peekfs itself is only
+// these and its main.
+
+struct fuse_lowlevel_ops;
+struct Database;
+struct Mount;
+
+extern struct fuse_lowlevel_ops peek_oper;
+
+int peekmain(int argc, char *argv[]);
+int peekinit(void);
+void peekcleanup(void);
+struct Database *peekdb(void);
+int peekattach(struct Mount *mount);
+int peekstats(char *buf, size_t size);
\ No newline at end of file
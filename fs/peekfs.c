@@ -0,0 +1,6 @@
+#include <peek.h>
+
+int main(int argc, char *argv[])
+{
+    return peekmain(argc, argv);
+}
\ No newline at end of file
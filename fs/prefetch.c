@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "prefetch.h"
+
+// Whether the read running on the busy file is still wanted
+static int prefetchcheck(struct Prefetch *prefetch)
+{
+    pthread_mutex_lock(&prefetch->lock);
+    int live = !prefetch->stopping && !prefetch->cancelled;
+    pthread_mutex_unlock(&prefetch->lock);
+
+    return live;
+}
+
+static void *prefetchthread(void *arg)
+{
+    struct Prefetch *prefetch = (struct Prefetch *)arg;
+
+    pthread_mutex_lock(&prefetch->lock);
+
+    while (1)
+    {
+        while (!prefetch->head && !prefetch->stopping)
+            pthread_cond_wait(&prefetch->cond, &prefetch->lock);
+
+        // Anything left is only an optimization, so it isn't waited for
+        if (prefetch->stopping)
+            break;
+
+        struct PrefetchItem *item = prefetch->head;
+        if ((prefetch->head = item->next) == NULL)
+            prefetch->tail = &prefetch->head;
+
+        // Marked busy, so the file isn't closed while it is being read
+        prefetch->busy = item->fd;
+        prefetch->cancelled = 0;
+
+        pthread_mutex_unlock(&prefetch->lock);
+
+        // Blocks until the pages are in, which is the wait a read through
+        // the mount no longer has to take
+        size_t done;
+        for (done = 0; done < item->len; done += PREFETCH_CHUNK)
+        {
+            // Checked between pieces, so a cancel waits on at most one
+            if (!prefetchcheck(prefetch))
+                break;
+
+            size_t len = item->len - done;
+            readahead(item->fd, item->offset + done, len < PREFETCH_CHUNK ? len : PREFETCH_CHUNK);
+        }
+
+        free(item);
+
+        pthread_mutex_lock(&prefetch->lock);
+
+        prefetch->busy = -1;
+        pthread_cond_broadcast(&prefetch->cond);
+    }
+
+    pthread_mutex_unlock(&prefetch->lock);
+
+    return NULL;
+}
+
+int prefetchopen(struct Prefetch *prefetch)
+{
+    memset(prefetch, 0, sizeof(struct Prefetch));
+    prefetch->tail = &prefetch->head;
+    prefetch->busy = -1;
+
+    if (pthread_mutex_init(&prefetch->lock, NULL))
+    {
+        printf("Failed to create prefetch lock\n");
+        return -1;
+    }
+
+    if (pthread_cond_init(&prefetch->cond, NULL))
+    {
+        printf("Failed to create prefetch condition\n");
+        pthread_mutex_destroy(&prefetch->lock);
+        return -1;
+    }
+
+    if (pthread_create(&prefetch->thread, NULL, prefetchthread, prefetch))
+    {
+        printf("Failed to start prefetch thread\n");
+        pthread_cond_destroy(&prefetch->cond);
+        pthread_mutex_destroy(&prefetch->lock);
+        return -1;
+    }
+
+    prefetch->started = 1;
+
+    return 0;
+}
+
+void prefetchclose(struct Prefetch *prefetch)
+{
+    if (!prefetch->started)
+        return;
+
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->stopping = 1;
+    pthread_cond_broadcast(&prefetch->cond);
+    pthread_mutex_unlock(&prefetch->lock);
+
+    pthread_join(prefetch->thread, NULL);
+    prefetch->started = 0;
+
+    struct PrefetchItem *item = prefetch->head;
+    while (item)
+    {
+        struct PrefetchItem *next = item->next;
+        free(item);
+        item = next;
+    }
+
+    prefetch->head = NULL;
+    prefetch->tail = &prefetch->head;
+
+    pthread_cond_destroy(&prefetch->cond);
+    pthread_mutex_destroy(&prefetch->lock);
+}
+
+int prefetchput(struct Prefetch *prefetch, int fd, off_t offset, size_t len)
+{
+    if (!prefetch->started)
+        return -1;
+
+    pthread_mutex_lock(&prefetch->lock);
+
+    // A stream that gets ahead of the thread grows its waiting range
+    // instead of queueing another one
+    struct PrefetchItem *item;
+    for (item = prefetch->head; item; item = item->next)
+    {
+        if (item->fd == fd && offset >= item->offset && offset <= item->offset + (off_t)item->len)
+        {
+            if (offset + (off_t)len > item->offset + (off_t)item->len)
+                item->len = offset + len - item->offset;
+
+            pthread_mutex_unlock(&prefetch->lock);
+            return 0;
+        }
+    }
+
+    if ((item = malloc(sizeof(struct PrefetchItem))) == NULL)
+    {
+        pthread_mutex_unlock(&prefetch->lock);
+        return -1;
+    }
+
+    item->next = NULL;
+    item->fd = fd;
+    item->offset = offset;
+    item->len = len;
+
+    *prefetch->tail = item;
+    prefetch->tail = &item->next;
+    pthread_cond_signal(&prefetch->cond);
+
+    pthread_mutex_unlock(&prefetch->lock);
+
+    return 0;
+}
+
+void prefetchcancel(struct Prefetch *prefetch, int fd)
+{
+    if (!prefetch->started)
+        return;
+
+    pthread_mutex_lock(&prefetch->lock);
+
+    struct PrefetchItem **link = &prefetch->head;
+    while (*link)
+    {
+        struct PrefetchItem *item = *link;
+        if (item->fd == fd)
+        {
+            *link = item->next;
+            free(item);
+        }
+        else
+        {
+            link = &item->next;
+        }
+    }
+
+    prefetch->tail = link;
+
+    // The descriptor may be closed and its number reused as soon as this
+    // returns, so a read already running on it has to stop first
+    if (prefetch->busy == fd)
+        prefetch->cancelled = 1;
+
+    while (prefetch->busy == fd)
+        pthread_cond_wait(&prefetch->cond, &prefetch->lock);
+
+    pthread_mutex_unlock(&prefetch->lock);
+}
\ No newline at end of file
@@ -0,0 +1,37 @@
+#include <pthread.h>
+#include <sys/types.h>
+
+// Reads ahead of a stream start small and double while it keeps going
+#define PREFETCH_MIN (256 * 1024)
+#define PREFETCH_MAX (8 * 1024 * 1024)
+
+// The kernel caps a single readahead at the device's readahead window,
+// so longer ranges are handed over in pieces no bigger than its default
+#define PREFETCH_CHUNK (128 * 1024)
+
+// A range of a file to be pulled into the page cache
+struct PrefetchItem
+{
+    struct PrefetchItem *next;
+    int fd;
+    off_t offset;
+    size_t len;
+};
+
+struct Prefetch
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct PrefetchItem *head;
+    struct PrefetchItem **tail;
+    int busy;
+    int cancelled;
+    int stopping;
+    pthread_t thread;
+    int started;
+};
+
+int prefetchopen(struct Prefetch *prefetch);
+void prefetchclose(struct Prefetch *prefetch);
+int prefetchput(struct Prefetch *prefetch, int fd, off_t offset, size_t len);
+void prefetchcancel(struct Prefetch *prefetch, int fd);
\ No newline at end of file
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "queue.h"
+
+static void queuefree(struct QueueItem *items)
+{
+    while (items)
+    {
+        struct QueueItem *next = items->next;
+        free(items);
+        items = next;
+    }
+}
+
+static void *queuethread(void *arg)
+{
+    struct Queue *queue = (struct Queue *)arg;
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (1)
+    {
+        while (!queue->head && !queue->stopping)
+            pthread_cond_wait(&queue->cond, &queue->lock);
+
+        if (!queue->head)
+            break;
+
+        // Give a burst of changes a moment to arrive, so they all share
+        // one commit and one sync. Every change moves the deadline, which
+        // is read again on each wakeup.
+        while (!queue->stopping && pthread_cond_timedwait(&queue->cond, &queue->lock, &queue->until) != ETIMEDOUT);
+
+        // Still visible to readers until the commit is done, so nothing
+        // flickers back to its old state in between
+        queue->flushing = queue->head;
+        queue->head = NULL;
+        queue->tail = &queue->head;
+
+        pthread_mutex_unlock(&queue->lock);
+
+        if (queue->flush(queue->arg, queue->flushing))
+            printf("Failed to write queued changes\n");
+
+        pthread_mutex_lock(&queue->lock);
+
+        queuefree(queue->flushing);
+        queue->flushing = NULL;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+int queueopen(struct Queue *queue, queue_flush_t flush, void *arg)
+{
+    memset(queue, 0, sizeof(struct Queue));
+    queue->tail = &queue->head;
+    queue->flush = flush;
+    queue->arg = arg;
+
+    if (pthread_mutex_init(&queue->lock, NULL))
+    {
+        printf("Failed to create queue lock\n");
+        return -1;
+    }
+
+    if (pthread_cond_init(&queue->cond, NULL))
+    {
+        printf("Failed to create queue condition\n");
+        pthread_mutex_destroy(&queue->lock);
+        return -1;
+    }
+
+    if (pthread_create(&queue->thread, NULL, queuethread, queue))
+    {
+        printf("Failed to start queue thread\n");
+        pthread_cond_destroy(&queue->cond);
+        pthread_mutex_destroy(&queue->lock);
+        return -1;
+    }
+
+    queue->started = 1;
+
+    return 0;
+}
+
+void queueclose(struct Queue *queue)
+{
+    if (!queue->started)
+        return;
+
+    // Whatever is still queued gets written before the thread exits
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_join(queue->thread, NULL);
+    queue->started = 0;
+
+    queuefree(queue->head);
+    queue->head = NULL;
+    queue->tail = &queue->head;
+
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->lock);
+}
+
+int queueput(struct Queue *queue, int del, const char *key, const char *data)
+{
+    size_t keylen = strlen(key) + 1;
+    size_t datalen = strlen(data) + 1;
+
+    struct QueueItem *item;
+    if ((item = malloc(sizeof(struct QueueItem) + keylen + datalen)) == NULL)
+        return -1;
+
+    item->next = NULL;
+    item->del = del;
+    item->key = item->buf;
+    item->data = item->buf + keylen;
+    memcpy(item->key, key, keylen);
+    memcpy(item->data, data, datalen);
+
+    pthread_mutex_lock(&queue->lock);
+
+    clock_gettime(CLOCK_REALTIME, &queue->until);
+    queue->until.tv_sec += QUEUE_DELAY_MS / 1000;
+    queue->until.tv_nsec += (QUEUE_DELAY_MS % 1000) * 1000000L;
+    if (queue->until.tv_nsec >= 1000000000L)
+    {
+        queue->until.tv_sec++;
+        queue->until.tv_nsec -= 1000000000L;
+    }
+
+    *queue->tail = item;
+    queue->tail = &item->next;
+    pthread_cond_signal(&queue->cond);
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return 0;
+}
+
+int queuepending(struct Queue *queue, const char *key, const char *data)
+{
+    int result = -1;
+
+    if (!queue->started)
+        return result;
+
+    pthread_mutex_lock(&queue->lock);
+
+    // The last change to a pair wins, and everything still queued is
+    // newer than what is being flushed
+    struct QueueItem *item;
+    for (item = queue->flushing; item; item = item->next)
+    {
+        if (strcmp(item->key, key) == 0 && strcmp(item->data, data) == 0)
+            result = !item->del;
+    }
+
+    for (item = queue->head; item; item = item->next)
+    {
+        if (strcmp(item->key, key) == 0 && strcmp(item->data, data) == 0)
+            result = !item->del;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return result;
+}
\ No newline at end of file
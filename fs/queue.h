@@ -0,0 +1,36 @@
+#include <pthread.h>
+#include <time.h>
+
+#define QUEUE_DELAY_MS 500
+
+// A database write waiting for the flusher
+struct QueueItem
+{
+    struct QueueItem *next;
+    int del;
+    char *key;
+    char *data;
+    char buf[];
+};
+
+typedef int (*queue_flush_t)(void *arg, struct QueueItem *items);
+
+struct Queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct QueueItem *head;
+    struct QueueItem **tail;
+    struct QueueItem *flushing;
+    struct timespec until;
+    queue_flush_t flush;
+    void *arg;
+    int stopping;
+    pthread_t thread;
+    int started;
+};
+
+int queueopen(struct Queue *queue, queue_flush_t flush, void *arg);
+void queueclose(struct Queue *queue);
+int queueput(struct Queue *queue, int del, const char *key, const char *data);
+int queuepending(struct Queue *queue, const char *key, const char *data);
\ No newline at end of file
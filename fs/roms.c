@@ -0,0 +1,560 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include "roms.h"
+
+#define ROMS_BUCKETS 1024
+#define BUFFER_SIZE 4096
+#define EVENT_SIZE ( sizeof (struct inotify_event) )
+#define EVENT_BUFFER_SIZE ( 64 * ( EVENT_SIZE + 256 ) )
+
+static unsigned int romshash(const char *name)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (; *name; name++)
+    {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void romsgrow(struct Roms *roms)
+{
+    unsigned int bucketslen = roms->bucketslen * 2;
+    struct RomsEntry **buckets = calloc(bucketslen, sizeof(struct RomsEntry *));
+    if (!buckets)
+        return;
+
+    unsigned int i;
+    for (i = 0; i < roms->bucketslen; i++)
+    {
+        struct RomsEntry *entry = roms->buckets[i];
+        while (entry)
+        {
+            struct RomsEntry *next = entry->next;
+            unsigned int bucket = romshash(entry->name) % bucketslen;
+
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+
+    free(roms->buckets);
+    roms->buckets = buckets;
+    roms->bucketslen = bucketslen;
+}
+
+static struct RomsEntry *romsfind(struct Roms *roms, const char *name)
+{
+    struct RomsEntry *entry;
+    for (entry = roms->buckets[romshash(name) % roms->bucketslen]; entry; entry = entry->next)
+    {
+        if (strcmp(entry->name, name) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+static struct RomsEntry *romsadd(struct Roms *roms, const char *name, ino_t ino)
+{
+    struct RomsEntry *entry;
+    if ((entry = romsfind(roms, name)))
+        return entry;
+
+    size_t namelen = strlen(name) + 1;
+    if ((entry = malloc(sizeof(struct RomsEntry) + namelen)) == NULL)
+        return NULL;
+
+    memcpy(entry->name, name, namelen);
+    entry->ino = ino;
+    entry->hasstat = 0;
+
+    unsigned int bucket = romshash(name) % roms->bucketslen;
+    entry->next = roms->buckets[bucket];
+    roms->buckets[bucket] = entry;
+
+    int letter = romsletterindex(name[0]);
+    entry->letterprev = NULL;
+    entry->letternext = roms->letters[letter];
+    if (entry->letternext)
+        entry->letternext->letterprev = entry;
+    roms->letters[letter] = entry;
+
+    if (++roms->count > roms->bucketslen)
+        romsgrow(roms);
+
+    return entry;
+}
+
+static void romsremove(struct Roms *roms, const char *name)
+{
+    struct RomsEntry **link = &roms->buckets[romshash(name) % roms->bucketslen];
+    while (*link)
+    {
+        struct RomsEntry *entry = *link;
+        if (strcmp(entry->name, name) == 0)
+        {
+            *link = entry->next;
+
+            if (entry->letterprev)
+                entry->letterprev->letternext = entry->letternext;
+            else
+                roms->letters[romsletterindex(entry->name[0])] = entry->letternext;
+
+            if (entry->letternext)
+                entry->letternext->letterprev = entry->letterprev;
+
+            free(entry);
+            roms->count--;
+            break;
+        }
+
+        link = &entry->next;
+    }
+}
+
+static void romsreset(struct Roms *roms)
+{
+    unsigned int i;
+    for (i = 0; i < roms->bucketslen; i++)
+    {
+        struct RomsEntry *entry = roms->buckets[i];
+        while (entry)
+        {
+            struct RomsEntry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+
+        roms->buckets[i] = NULL;
+    }
+
+    for (i = 0; i < ROMS_LETTERS; i++)
+        roms->letters[i] = NULL;
+
+    roms->count = 0;
+}
+
+static void romsfound(struct Roms *roms, const char *name)
+{
+    // Only regular files are indexed, so new names are checked first
+    char path[BUFFER_SIZE];
+    snprintf(path, BUFFER_SIZE, "%s/%s", roms->path, name);
+
+    struct stat st;
+    if (stat(path, &st) || !S_ISREG(st.st_mode))
+        return;
+
+    pthread_rwlock_wrlock(&roms->lock);
+
+    roms->gen++;
+
+    struct RomsEntry *entry;
+    if ((entry = romsadd(roms, name, st.st_ino)))
+    {
+        entry->st = st;
+        entry->hasstat = 1;
+    }
+
+    pthread_rwlock_unlock(&roms->lock);
+}
+
+static void romslost(struct Roms *roms, const char *name)
+{
+    pthread_rwlock_wrlock(&roms->lock);
+
+    roms->gen++;
+    romsremove(roms, name);
+
+    pthread_rwlock_unlock(&roms->lock);
+}
+
+static void romschanged(struct Roms *roms, const char *name)
+{
+    pthread_rwlock_wrlock(&roms->lock);
+
+    roms->gen++;
+
+    struct RomsEntry *entry;
+    if ((entry = romsfind(roms, name)))
+        entry->hasstat = 0;
+
+    pthread_rwlock_unlock(&roms->lock);
+}
+
+static int romsscan(struct Roms *roms)
+{
+    DIR *dp;
+    if ((dp = opendir(roms->path)) == NULL)
+    {
+        printf("Failed to scan source path: %s\n", roms->path);
+        return -1;
+    }
+
+    int fd = dirfd(dp);
+
+    pthread_rwlock_wrlock(&roms->lock);
+    roms->gen++;
+    romsreset(roms);
+    pthread_rwlock_unlock(&roms->lock);
+
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL)
+    {
+        // Links are followed, as they are for new files and getattr, so
+        // the index holds the same files however it was filled
+        if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK)
+        {
+            struct stat st;
+            if (fstatat(fd, de->d_name, &st, 0) || !S_ISREG(st.st_mode))
+                continue;
+        }
+        else if (de->d_type != DT_REG)
+        {
+            continue;
+        }
+
+        pthread_rwlock_wrlock(&roms->lock);
+        romsadd(roms, de->d_name, de->d_ino);
+        pthread_rwlock_unlock(&roms->lock);
+    }
+
+    closedir(dp);
+
+    return 0;
+}
+
+static void romsfill(struct Roms *roms)
+{
+    DIR *dp;
+    if ((dp = opendir(roms->path)) == NULL)
+        return;
+
+    int fd = dirfd(dp);
+
+    // Attributes are read without the lock held, so any change made in the
+    // meantime keeps them out of the snapshot
+    struct dirent *de;
+    while (roms->watching && (de = readdir(dp)) != NULL)
+    {
+        if (de->d_type != DT_REG && de->d_type != DT_LNK && de->d_type != DT_UNKNOWN)
+            continue;
+
+        unsigned int gen = romsgen(roms);
+
+        struct stat st;
+        if (!fstatat(fd, de->d_name, &st, 0))
+            romsput(roms, de->d_name, &st, gen);
+    }
+
+    closedir(dp);
+}
+
+static void romsevent(struct Roms *roms, struct inotify_event *event)
+{
+    if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT))
+    {
+        // The folder itself went away, so the index can't be kept current
+        printf("Lost watch on source path: %s\n", roms->path);
+        roms->watching = 0;
+        return;
+    }
+
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+        // Events were lost, so start over from the folder itself
+        printf("Rescanning source path: %s\n", roms->path);
+        if (romsscan(roms))
+            roms->watching = 0;
+        else
+            romsfill(roms);
+        return;
+    }
+
+    if (event->len == 0 || (event->mask & IN_ISDIR))
+        return;
+
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+        romslost(roms, event->name);
+    else if (event->mask & (IN_CREATE | IN_MOVED_TO))
+        romsfound(roms, event->name);
+    else
+        romschanged(roms, event->name);
+}
+
+static void *romsthread(void *arg)
+{
+    struct Roms *roms = (struct Roms *)arg;
+    char buf[EVENT_BUFFER_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    // The scan only took names, attributes are filled in here so mounting
+    // doesn't wait on a stat of every file. Events queue up meanwhile.
+    romsfill(roms);
+
+    while (roms->watching)
+    {
+        int readlen = read(roms->notifyid, buf, EVENT_BUFFER_SIZE);
+        if (readlen <= 0)
+        {
+            if (readlen < 0 && errno == EINTR)
+                continue;
+
+            printf("Error from source path notify read: %d: %s\n", readlen, strerror(errno));
+            roms->watching = 0;
+            break;
+        }
+
+        struct inotify_event *event;
+        int i;
+        for (i = 0; i < readlen; i += EVENT_SIZE + event->len)
+        {
+            event = (struct inotify_event *)&buf[i];
+            romsevent(roms, event);
+        }
+    }
+
+    return NULL;
+}
+
+int romsopen(struct Roms *roms, char *path)
+{
+    memset(roms, 0, sizeof(struct Roms));
+
+    roms->path = path;
+    roms->notifyid = -1;
+
+    if (pthread_rwlock_init(&roms->lock, NULL))
+    {
+        printf("Failed to create source path lock\n");
+        return -1;
+    }
+
+    if ((roms->buckets = calloc(ROMS_BUCKETS, sizeof(struct RomsEntry *))) == NULL)
+    {
+        printf("Failed to allocate source path table\n");
+        return -1;
+    }
+
+    roms->bucketslen = ROMS_BUCKETS;
+
+    // Without a watch, the index could go stale, so it is only used while
+    // the watch is healthy
+    if ((roms->notifyid = inotify_init()) < 0)
+    {
+        printf("Failed to initialize source path notify\n");
+        return 0;
+    }
+
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB
+        | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF;
+    if (inotify_add_watch(roms->notifyid, path, mask) < 0)
+    {
+        printf("Failed to watch source path: %s\n", path);
+        return 0;
+    }
+
+    // The watch is added before scanning, so nothing created during the
+    // scan is missed
+    if (romsscan(roms))
+        return 0;
+
+    roms->watching = 1;
+
+    if (pthread_create(&roms->thread, NULL, romsthread, roms))
+    {
+        printf("Failed to start source path notify thread\n");
+        roms->watching = 0;
+        return 0;
+    }
+
+    roms->started = 1;
+
+    return 0;
+}
+
+void romsclose(struct Roms *roms)
+{
+    roms->watching = 0;
+
+    if (roms->started)
+    {
+        pthread_cancel(roms->thread);
+        pthread_join(roms->thread, NULL);
+        roms->started = 0;
+    }
+
+    if (roms->notifyid >= 0)
+    {
+        close(roms->notifyid);
+        roms->notifyid = -1;
+    }
+
+    if (roms->buckets)
+    {
+        romsreset(roms);
+        free(roms->buckets);
+        roms->buckets = NULL;
+    }
+
+    pthread_rwlock_destroy(&roms->lock);
+}
+
+unsigned int romsgen(struct Roms *roms)
+{
+    unsigned int gen;
+
+    pthread_rwlock_rdlock(&roms->lock);
+    gen = roms->gen;
+    pthread_rwlock_unlock(&roms->lock);
+
+    return gen;
+}
+
+int romsletterindex(char letter)
+{
+    if (letter >= 'A' && letter <= 'Z')
+        return letter - 'A' + 1;
+
+    if (letter >= 'a' && letter <= 'z')
+        return letter - 'a' + 1;
+
+    return 0;
+}
+
+int romsletter(struct Roms *roms, int index, roms_each_t each, void *arg)
+{
+    if (!roms->watching)
+        return -1;
+
+    pthread_rwlock_rdlock(&roms->lock);
+
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG;
+
+    struct RomsEntry *entry;
+    for (entry = roms->letters[index]; entry; entry = entry->letternext)
+    {
+        st.st_ino = entry->ino;
+        if (each(arg, entry->name, &st))
+            break;
+    }
+
+    pthread_rwlock_unlock(&roms->lock);
+
+    return 0;
+}
+
+int romseach(struct Roms *roms, roms_each_t each, void *arg)
+{
+    if (!roms->watching)
+        return -1;
+
+    pthread_rwlock_rdlock(&roms->lock);
+
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG;
+
+    int res = 0;
+    int index;
+    for (index = 0; index < ROMS_LETTERS && !res; index++)
+    {
+        struct RomsEntry *entry;
+        for (entry = roms->letters[index]; entry && !res; entry = entry->letternext)
+        {
+            st.st_ino = entry->ino;
+            res = each(arg, entry->name, &st);
+        }
+    }
+
+    pthread_rwlock_unlock(&roms->lock);
+
+    return res;
+}
+
+int romsstat(struct Roms *roms, const char *name, struct stat *st)
+{
+    if (!roms->watching)
+        return -1;
+
+    int res = -1;
+
+    pthread_rwlock_rdlock(&roms->lock);
+
+    struct RomsEntry *entry;
+    if ((entry = romsfind(roms, name)) && entry->hasstat)
+    {
+        *st = entry->st;
+        res = 0;
+    }
+
+    pthread_rwlock_unlock(&roms->lock);
+
+    return res;
+}
+
+int romslookup(struct Roms *roms, const char *name, struct stat *st)
+{
+    if (!roms->watching)
+        return -1;
+
+    int res = 1;
+
+    pthread_rwlock_rdlock(&roms->lock);
+
+    struct RomsEntry *entry;
+    if ((entry = romsfind(roms, name)))
+    {
+        // Until its attributes are filled in, a file is known by name and
+        // inode, which is all a listing needs
+        if (entry->hasstat)
+        {
+            *st = entry->st;
+        }
+        else
+        {
+            memset(st, 0, sizeof(struct stat));
+            st->st_ino = entry->ino;
+            st->st_mode = S_IFREG;
+        }
+
+        res = 0;
+    }
+
+    pthread_rwlock_unlock(&roms->lock);
+
+    return res;
+}
+
+void romsput(struct Roms *roms, const char *name, const struct stat *st, unsigned int gen)
+{
+    if (!roms->watching || !S_ISREG(st->st_mode))
+        return;
+
+    pthread_rwlock_wrlock(&roms->lock);
+
+    // Something changed since the caller read the attributes, so they
+    // may already be stale
+    if (gen == roms->gen)
+    {
+        struct RomsEntry *entry;
+        if ((entry = romsadd(roms, name, st->st_ino)))
+        {
+            entry->st = *st;
+            entry->hasstat = 1;
+        }
+    }
+
+    pthread_rwlock_unlock(&roms->lock);
+}
\ No newline at end of file
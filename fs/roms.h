@@ -0,0 +1,43 @@
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define ROMS_LETTERS 27
+
+struct RomsEntry
+{
+    struct RomsEntry *next;
+    struct RomsEntry *letternext;
+    struct RomsEntry *letterprev;
+    ino_t ino;
+    int hasstat;
+    struct stat st;
+    char name[];
+};
+
+struct Roms
+{
+    char *path;
+    pthread_rwlock_t lock;
+    struct RomsEntry **buckets;
+    unsigned int bucketslen;
+    unsigned int count;
+    struct RomsEntry *letters[ROMS_LETTERS];
+    unsigned int gen;
+    volatile int watching;
+    int notifyid;
+    pthread_t thread;
+    int started;
+};
+
+typedef int (*roms_each_t)(void *arg, const char *name, const struct stat *st);
+
+int romsopen(struct Roms *roms, char *path);
+void romsclose(struct Roms *roms);
+int romsletterindex(char letter);
+int romsletter(struct Roms *roms, int index, roms_each_t each, void *arg);
+int romseach(struct Roms *roms, roms_each_t each, void *arg);
+unsigned int romsgen(struct Roms *roms);
+int romsstat(struct Roms *roms, const char *name, struct stat *st);
+int romslookup(struct Roms *roms, const char *name, struct stat *st);
+void romsput(struct Roms *roms, const char *name, const struct stat *st, unsigned int gen);
\ No newline at end of file
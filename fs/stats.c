@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+static const char *__statsnames[STATS_OPS] = {
+    "lookup",
+    "getattr",
+    "readlink",
+    "mkdir",
+    "rmdir",
+    "rename",
+    "getxattr",
+    "listxattr",
+    "opendir",
+    "readdir",
+    "open",
+    "read",
+    "build",
+    "db",
+    "stat",
+    "diropen"
+};
+
+void statsinit(struct Stats *stats)
+{
+    memset(stats, 0, sizeof(struct Stats));
+    stats->started = statsnow();
+}
+
+uint64_t statsnow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int statsbucket(uint64_t elapsed)
+{
+    int bucket = 0;
+    while (elapsed > 1 && bucket < STATS_BUCKETS - 1)
+    {
+        elapsed >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+void statsrecord(struct Stats *stats, enum statsop op, uint64_t elapsed)
+{
+    struct StatsHist *hist = &stats->ops[op];
+
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->total, elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->buckets[statsbucket(elapsed)], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (elapsed > max
+        && !__atomic_compare_exchange_n(&hist->max, &max, elapsed, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+uint64_t statsadd(struct Stats *stats, enum statsop op, uint64_t start)
+{
+    uint64_t elapsed = statsnow() - start;
+    statsrecord(stats, op, elapsed);
+
+    return elapsed;
+}
+
+static double statspercentile(uint32_t *buckets, uint32_t count, double percentile)
+{
+    // Reported as the top of the bucket the percentile lands in, which is
+    // never more than twice the real value
+    uint32_t rank = (uint32_t)(count * percentile);
+    if (rank >= count)
+        rank = count - 1;
+
+    uint32_t seen = 0;
+    int i;
+    for (i = 0; i < STATS_BUCKETS; i++)
+    {
+        seen += buckets[i];
+        if (seen > rank)
+            break;
+    }
+
+    if (i == STATS_BUCKETS)
+        i--;
+
+    return (double)(2ULL << i) / 1000.0;
+}
+
+int statsprint(struct Stats *stats, char *buf, size_t size)
+{
+    size_t len = 0;
+    int res;
+
+    res = snprintf(buf, size, "uptime %llus, times in microseconds\n%-9s %10s %10s %10s %10s %10s %10s\n",
+        (unsigned long long)((statsnow() - stats->started) / 1000000000ULL),
+        "op", "count", "mean", "p50", "p90", "p99", "max");
+    if (res < 0 || (size_t)res >= size)
+        return -1;
+
+    len += res;
+
+    int op;
+    for (op = 0; op < STATS_OPS; op++)
+    {
+        struct StatsHist *hist = &stats->ops[op];
+
+        // A copy, so the row adds up even while other threads record
+        uint32_t buckets[STATS_BUCKETS];
+        uint32_t count = 0;
+        int i;
+        for (i = 0; i < STATS_BUCKETS; i++)
+        {
+            buckets[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+            count += buckets[i];
+        }
+
+        uint64_t total = __atomic_load_n(&hist->total, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+        if (count == 0)
+        {
+            res = snprintf(buf + len, size - len, "%-9s %10u %10s %10s %10s %10s %10s\n",
+                __statsnames[op], 0, "-", "-", "-", "-", "-");
+        }
+        else
+        {
+            res = snprintf(buf + len, size - len, "%-9s %10u %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                __statsnames[op], count,
+                total / 1000.0 / count,
+                statspercentile(buckets, count, 0.50),
+                statspercentile(buckets, count, 0.90),
+                statspercentile(buckets, count, 0.99),
+                max / 1000.0);
+        }
+
+        if (res < 0 || (size_t)res >= size - len)
+            return -1;
+
+        len += res;
+    }
+
+    return len;
+}
\ No newline at end of file
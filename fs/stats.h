@@ -0,0 +1,49 @@
+#include <stdint.h>
+#include <stddef.h>
+
+// Buckets are powers of two in nanoseconds, the last one holds anything
+// slower than about 70 seconds
+#define STATS_BUCKETS 36
+
+enum statsop
+{
+    STATS_LOOKUP,
+    STATS_GETATTR,
+    STATS_READLINK,
+    STATS_MKDIR,
+    STATS_RMDIR,
+    STATS_RENAME,
+    STATS_GETXATTR,
+    STATS_LISTXATTR,
+    STATS_OPENDIR,
+    STATS_READDIR,
+    STATS_OPEN,
+    STATS_READ,
+    STATS_BUILD,
+    STATS_DB,
+    STATS_STAT,
+    STATS_DIROPEN,
+    STATS_OPS
+};
+
+// Updated with atomics from every FUSE thread, so recording never waits
+// on a lock and reading only ever sees a slightly old total
+struct StatsHist
+{
+    uint32_t count;
+    uint64_t total;
+    uint64_t max;
+    uint32_t buckets[STATS_BUCKETS];
+};
+
+struct Stats
+{
+    uint64_t started;
+    struct StatsHist ops[STATS_OPS];
+};
+
+void statsinit(struct Stats *stats);
+uint64_t statsnow(void);
+uint64_t statsadd(struct Stats *stats, enum statsop op, uint64_t start);
+void statsrecord(struct Stats *stats, enum statsop op, uint64_t elapsed);
+int statsprint(struct Stats *stats, char *buf, size_t size);
\ No newline at end of file
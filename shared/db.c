@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/stat.h>
@@ -10,6 +11,24 @@
 #define BUFFER_SIZE 4096
 
 static char *_dbpath;
+static size_t _dbmapsize = (size_t)1048576 * (size_t)50; // 1MB * 50
+
+static int dbupgrade(struct Database *db);
+
+static int dbopenfail(struct Database *db)
+{
+    // Nothing is left open, so a later dbopen starts from scratch
+    if (db->txn)
+    {
+        mdb_txn_abort(db->txn);
+        db->txn = NULL;
+    }
+
+    mdb_env_close(db->env);
+    db->env = NULL;
+
+    return -1;
+}
 
 int dbopen(struct Database *db)
 {
@@ -44,42 +63,166 @@ int dbopen(struct Database *db)
         return -1;
     }
 
-    mdb_env_set_maxdbs(db->env, 5);
-    mdb_env_set_mapsize(db->env, (size_t)1048576 * (size_t)50); // 1MB * 50
+    mdb_env_set_maxdbs(db->env, 16);
+    mdb_env_set_mapsize(db->env, _dbmapsize);
 
     if ((rc = mdb_env_open(db->env, _dbpath, 0, 0664)))
     {
         printf("Failed to open database environment: %d\n", rc);
-        return -1;
+        return dbopenfail(db);
     }
 
-    if (!dbtxnopen(db, 0))
+    if (dbtxnopen(db, 0))
+        return dbopenfail(db);
+
+    if ((rc = mdb_dbi_open(db->txn, "fil", MDB_DUPSORT | MDB_CREATE, &db->dbfil)))
     {
-        if ((rc = mdb_dbi_open(db->txn, "fil", MDB_DUPSORT | MDB_CREATE, &db->dbfil)))
-        {
-            printf("Failed to open filter database: %d\n", rc);
-            return -1;
-        }
+        printf("Failed to open filter database: %d\n", rc);
+        return dbopenfail(db);
+    }
 
-        if ((rc = mdb_dbi_open(db->txn, "str", MDB_CREATE, &db->dbstr)))
-        {
-            printf("Failed to open string database: %d\n", rc);
-            return -1;
-        }
+    if ((rc = mdb_dbi_open(db->txn, "fid", MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP | MDB_CREATE, &db->dbfid)))
+    {
+        printf("Failed to open file id database: %d\n", rc);
+        return dbopenfail(db);
+    }
+
+    if ((rc = mdb_dbi_open(db->txn, "str", MDB_CREATE, &db->dbstr)))
+    {
+        printf("Failed to open string database: %d\n", rc);
+        return dbopenfail(db);
+    }
+
+    if ((rc = mdb_dbi_open(db->txn, "sid", MDB_INTEGERKEY | MDB_CREATE, &db->dbsid)))
+    {
+        printf("Failed to open string id database: %d\n", rc);
+        return dbopenfail(db);
+    }
+
+    if ((rc = mdb_dbi_open(db->txn, "cnt", MDB_CREATE, &db->dbcnt)))
+    {
+        printf("Failed to open count database: %d\n", rc);
+        return dbopenfail(db);
+    }
+
+    if ((rc = mdb_dbi_open(db->txn, "sli", MDB_DUPSORT | MDB_CREATE, &db->dbsli)))
+    {
+        printf("Failed to open slice database: %d\n", rc);
+        return dbopenfail(db);
+    }
+
+    if ((rc = mdb_dbi_open(db->txn, "chg", MDB_CREATE, &db->dbchg)))
+    {
+        printf("Failed to open change database: %d\n", rc);
+        return dbopenfail(db);
+    }
+
+    if ((rc = mdb_dbi_open(db->txn, "rev", MDB_DUPSORT | MDB_CREATE, &db->dbrev)))
+    {
+        printf("Failed to open reverse database: %d\n", rc);
+        return dbopenfail(db);
+    }
 
-        dbtxnclose(db);
+    if ((rc = mdb_dbi_open(db->txn, "tri", MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP | MDB_CREATE, &db->dbtri)))
+    {
+        printf("Failed to open trigram database: %d\n", rc);
+        return dbopenfail(db);
+    }
+
+    if ((rc = mdb_dbi_open(db->txn, "idx", MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP | MDB_CREATE, &db->dbidx)))
+    {
+        printf("Failed to open index database: %d\n", rc);
+        return dbopenfail(db);
     }
 
-	return 0;
+    if (dbupgrade(db))
+        return dbopenfail(db);
+
+    if (dbtxnclose(db))
+        return dbopenfail(db);
+
+    return 0;
+}
+
+char *dbpath(void)
+{
+    return _dbpath;
+}
+
+int dbsetpath(const char *path, size_t mapsize)
+{
+    // Only for tools that keep their database somewhere else, such as the
+    // benchmarks, and only before the first open
+    char *copy;
+    if ((copy = strdup(path)) == NULL)
+        return -1;
+
+    free(_dbpath);
+    _dbpath = copy;
+
+    if (mapsize)
+        _dbmapsize = mapsize;
+
+    return 0;
 }
 
 void dbclose(struct Database *db)
 {
+    // Also called after a failed dbopen, which leaves nothing open
+    if (!db->env)
+        return;
+
+    dbreaderclose(db);
+
     mdb_dbi_close(db->env, db->dbfil);
+    mdb_dbi_close(db->env, db->dbfid);
     mdb_dbi_close(db->env, db->dbstr);
+    mdb_dbi_close(db->env, db->dbsid);
+    mdb_dbi_close(db->env, db->dbcnt);
+    mdb_dbi_close(db->env, db->dbsli);
+    mdb_dbi_close(db->env, db->dbrev);
+    mdb_dbi_close(db->env, db->dbtri);
+    mdb_dbi_close(db->env, db->dbidx);
+    mdb_dbi_close(db->env, db->dbchg);
     mdb_env_close(db->env);
 }
 
+int dbclone(struct Database *db, struct Database *src)
+{
+    // Shares the environment and database handles, but gets its own
+    // transaction and cursor. Each thread should use its own clone.
+    *db = (const struct Database){ 0 };
+
+    db->env = src->env;
+    db->dbfil = src->dbfil;
+    db->dbfid = src->dbfid;
+    db->dbstr = src->dbstr;
+    db->dbsid = src->dbsid;
+    db->dbcnt = src->dbcnt;
+    db->dbsli = src->dbsli;
+    db->dbrev = src->dbrev;
+    db->dbtri = src->dbtri;
+    db->dbidx = src->dbidx;
+    db->dbchg = src->dbchg;
+
+    return 0;
+}
+
+void dbreaderclose(struct Database *db)
+{
+    if (db->rdcur)
+    {
+        mdb_cursor_close(db->rdcur);
+        db->rdcur = NULL;
+    }
+
+    if (db->rdtxn)
+    {
+        mdb_txn_abort(db->rdtxn);
+        db->rdtxn = NULL;
+    }
+}
+
 int dbtxnopen(struct Database *db, int readonly)
 {
     if (db->txn)
@@ -89,14 +232,34 @@ int dbtxnopen(struct Database *db, int readonly)
     }
 
     int rc;
-    int flags = readonly ? MDB_RDONLY : 0;
-    if ((rc = mdb_txn_begin(db->env, NULL, flags, &db->txn))) 
+    if (readonly && db->rdtxn)
     {
-        printf("Failed to create transaction: %d\n", rc);
-        return -1;
+        // Read transactions are reset rather than aborted when closed, so
+        // they can be renewed without allocating a new one
+        if ((rc = mdb_txn_renew(db->rdtxn)))
+        {
+            printf("Failed to renew transaction: %d\n", rc);
+            return -1;
+        }
+
+        db->txn = db->rdtxn;
+    }
+    else
+    {
+        int flags = readonly ? MDB_RDONLY : 0;
+        if ((rc = mdb_txn_begin(db->env, NULL, flags, &db->txn))) 
+        {
+            printf("Failed to create transaction: %d\n", rc);
+            return -1;
+        }
+
+        if (readonly)
+            db->rdtxn = db->txn;
     }
 
     db->txnreadonly = readonly;
+    db->touchedlen = 0;
+    db->touchedall = 0;
 
     return 0;
 }
@@ -112,6 +275,41 @@ int dbtxncheck(struct Database *db)
     return 0;
 }
 
+static int dbstampput(struct Database *db, char *key, size_t txnid)
+{
+    MDB_val dbkey = {strlen(key) + 1, key};
+    MDB_val dbdata = {sizeof(txnid), &txnid};
+
+    int rc;
+    if ((rc = mdb_put(db->txn, db->dbchg, &dbkey, &dbdata, 0)))
+    {
+        printf("Failed to write change: %d\n", rc);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int dbstamp(struct Database *db)
+{
+    // Readers compare these with the last transaction they saw, to learn
+    // what a newer one changed without looking at the data itself
+    size_t txnid = mdb_txn_id(db->txn);
+    char all[] = "*";
+
+    if (db->touchedall && dbstampput(db, all, txnid))
+        return -1;
+
+    int i;
+    for (i = 0; i < db->touchedlen; i++)
+    {
+        if (dbstampput(db, db->touched[i], txnid))
+            return -1;
+    }
+
+    return 0;
+}
+
 int dbtxnclose(struct Database *db)
 {
     if (dbtxncheck(db))
@@ -120,13 +318,22 @@ int dbtxnclose(struct Database *db)
     int rc;
     if (db->txnreadonly)
     {
-        mdb_txn_abort(db->txn);
+        mdb_txn_reset(db->txn);
     }
     else
     {
+        if (dbstamp(db))
+        {
+            mdb_txn_abort(db->txn);
+            db->txn = NULL;
+            return -1;
+        }
+
+        // A failed commit frees the transaction as well
         if ((rc = mdb_txn_commit(db->txn)))
         {
             printf("Failed to commit transaction: %d\n", rc);
+            db->txn = NULL;
             return -1;
         }
     }
@@ -145,10 +352,26 @@ int dbcuropen(struct Database *db)
     }
 
     int rc;
-    if ((rc = mdb_cursor_open(db->txn, db->dbfil, &db->cur)))
+    if (db->txnreadonly && db->rdcur)
     {
-        printf("Failed to open cursor: %d\n", rc);
-        return -1;
+        if ((rc = mdb_cursor_renew(db->txn, db->rdcur)))
+        {
+            printf("Failed to renew cursor: %d\n", rc);
+            return -1;
+        }
+
+        db->cur = db->rdcur;
+    }
+    else
+    {
+        if ((rc = mdb_cursor_open(db->txn, db->dbfil, &db->cur)))
+        {
+            printf("Failed to open cursor: %d\n", rc);
+            return -1;
+        }
+
+        if (db->txnreadonly)
+            db->rdcur = db->cur;
     }
 
     return 0;
@@ -170,84 +393,1049 @@ int dbcurclose(struct Database *db)
     if (dbcurcheck(db))
         return -1;
 
-    mdb_cursor_close(db->cur);
+    // The read cursor is kept for renewal with the read transaction
+    if (db->cur != db->rdcur)
+        mdb_cursor_close(db->cur);
+
     db->cur = NULL;
 
     return 0;
 }
 
-int dbput(struct Database *db, char *key, char *data)
+static void dbtouch(struct Database *db, char *key)
 {
-    if (dbtxncheck(db))
-        return -1;
-    
-    MDB_val dbkey = {strlen(key) + 1, key};
-    MDB_val dbdata = {strlen(data) + 1, data};
+    // Noted as CORE/CLASS, so the changes to one core are a range
+    char *core = strchr(key, '/');
+    if (!core)
+    {
+        db->touchedall = 1;
+        return;
+    }
+
+    core++;
+    char *end = strchr(core, '/');
+    int corelen = end ? end - core : (int)strlen(core);
+    int classlen = core - 1 - key;
+
+    char touched[TOUCH_LEN];
+    if (snprintf(touched, TOUCH_LEN, "%.*s/%.*s", corelen, core, classlen, key) >= TOUCH_LEN)
+    {
+        db->touchedall = 1;
+        return;
+    }
+
+    int i;
+    for (i = 0; i < db->touchedlen; i++)
+    {
+        if (strcmp(db->touched[i], touched) == 0)
+            return;
+    }
+
+    if (db->touchedlen == TOUCH_MAX)
+    {
+        db->touchedall = 1;
+        return;
+    }
+
+    strcpy(db->touched[db->touchedlen++], touched);
+}
+
+static int dbcountput(struct Database *db, char *key, size_t size, long delta, int *edge)
+{
+    MDB_val dbkey = {size, key};
+    MDB_val dbdata;
+    unsigned int count = 0;
+    unsigned int old;
 
     int rc;
-    if ((rc = mdb_put(db->txn, db->dbfil, &dbkey, &dbdata, MDB_NODUPDATA)))
+    if (!(rc = mdb_get(db->txn, db->dbcnt, &dbkey, &dbdata)))
     {
-        if (rc != MDB_KEYEXIST)
+        if (dbdata.mv_size == sizeof(count))
+            memcpy(&count, dbdata.mv_data, sizeof(count));
+    }
+    else if (rc != MDB_NOTFOUND)
+    {
+        printf("Failed to read count: %d\n", rc);
+        return -1;
+    }
+
+    old = count;
+    if (delta < 0 && count < (unsigned long)-delta)
+        count = 0;
+    else
+        count += delta;
+
+    // Whether the key just came into or went out of existence
+    *edge = (old == 0 && count > 0) - (old > 0 && count == 0);
+
+    if (count == 0)
+    {
+        if ((rc = mdb_del(db->txn, db->dbcnt, &dbkey, NULL)) && rc != MDB_NOTFOUND)
         {
-            printf("Failed to write data: %d\n", rc);
+            printf("Failed to delete count: %d\n", rc);
             return -1;
         }
+
+        return 0;
+    }
+
+    dbdata.mv_size = sizeof(count);
+    dbdata.mv_data = &count;
+
+    if ((rc = mdb_put(db->txn, db->dbcnt, &dbkey, &dbdata, 0)))
+    {
+        printf("Failed to write count: %d\n", rc);
+        return -1;
     }
 
     return 0;
 }
 
-int dbdel(struct Database *db, char *key, char *data)
+static int dbsliceput(struct Database *db, char *parent, size_t parentlen, char *child, size_t childlen, int edge)
 {
-    if (dbtxncheck(db))
+    MDB_val dbkey = {parentlen, parent};
+    MDB_val dbdata = {childlen, child};
+
+    int rc;
+    if (edge > 0)
+        rc = mdb_put(db->txn, db->dbsli, &dbkey, &dbdata, MDB_NODUPDATA);
+    else
+        rc = mdb_del(db->txn, db->dbsli, &dbkey, &dbdata);
+
+    if (rc && rc != MDB_KEYEXIST && rc != MDB_NOTFOUND)
+    {
+        printf("Failed to write slice: %d\n", rc);
         return -1;
+    }
 
-    MDB_val dbkey = {strlen(key) + 1, key};
-    MDB_val dbdata;
-    if (data)
+    return 0;
+}
+
+static int dbcountadd(struct Database *db, char *key, long delta)
+{
+    size_t keylen = strlen(key);
+    char tmp[BUFFER_SIZE];
+
+    if (keylen >= BUFFER_SIZE)
+        return -1;
+
+    memcpy(tmp, key, keylen + 1);
+
+    // Every change to the data comes through here
+    dbtouch(db, key);
+
+    // Every level above the key counts its data as well, so the size of
+    // any folder is a single lookup. A level coming or going also adds or
+    // removes it from the slice of its parent.
+    size_t last = 0;
+    size_t i;
+    for (i = 1; i <= keylen; i++)
     {
-        dbdata.mv_size = strlen(data) + 1;
-        dbdata.mv_data = data;
+        if (i < keylen && tmp[i] != '/')
+            continue;
+
+        char c = tmp[i];
+        tmp[i] = '\0';
+
+        int edge = 0;
+        int res = dbcountput(db, tmp, i + 1, delta, &edge);
+
+        if (!res && edge && last > 0)
+        {
+            tmp[last] = '\0';
+            res = dbsliceput(db, tmp, last + 1, tmp + last + 1, i - last, edge);
+            tmp[last] = '/';
+        }
+
+        tmp[i] = c;
+
+        if (res)
+            return -1;
+
+        last = i;
     }
 
+    return 0;
+}
+
+
+int dbstrid(struct Database *db, char *str, unsigned int *id)
+{
+    if (dbtxncheck(db))
+        return -1;
+
+    MDB_val dbstr = {strlen(str) + 1, str};
+    MDB_val dbid;
+
     int rc;
-    if ((rc = mdb_del(db->txn, db->dbfil, &dbkey, data ? &dbdata : NULL)))
+    if ((rc = mdb_get(db->txn, db->dbstr, &dbstr, &dbid)))
     {
         if (rc != MDB_NOTFOUND)
         {
-            printf("Failed to delete data: %d\n", rc);
+            printf("Failed to read string: %d\n", rc);
             return -1;
         }
+
+        return 1;
     }
 
+    if (dbid.mv_size != sizeof(*id))
+        return -1;
+
+    memcpy(id, dbid.mv_data, sizeof(*id));
+
     return 0;
 }
 
-int dbstrget(struct Database *db, char *str, unsigned int id)
+char *dbstrget(struct Database *db, unsigned int id)
 {
-    return 0;
+    if (dbtxncheck(db))
+        return NULL;
+
+    MDB_val dbid = {sizeof(id), &id};
+    MDB_val dbstr;
+
+    if (mdb_get(db->txn, db->dbsid, &dbid, &dbstr))
+        return NULL;
+
+    return (char *)dbstr.mv_data;
 }
 
 int dbstrput(struct Database *db, char *str, unsigned int *id)
 {
-    // int rc;
+    int res;
+    if ((res = dbstrid(db, str, id)) <= 0)
+        return res;
+
+    // Strings are never removed, so the next id is one past the last and
+    // the id database is only ever appended to
+    int rc;
+    MDB_cursor *cur;
+    if ((rc = mdb_cursor_open(db->txn, db->dbsid, &cur)))
+    {
+        printf("Failed to open cursor: %d\n", rc);
+        return -1;
+    }
+
+    MDB_val dbid;
+    MDB_val dbstr;
+
+    *id = 1;
+    if (!mdb_cursor_get(cur, &dbid, &dbstr, MDB_LAST) && dbid.mv_size == sizeof(*id))
+    {
+        memcpy(id, dbid.mv_data, sizeof(*id));
+        (*id)++;
+    }
+
+    mdb_cursor_close(cur);
+
+    dbid.mv_size = sizeof(*id);
+    dbid.mv_data = id;
+    dbstr.mv_size = strlen(str) + 1;
+    dbstr.mv_data = str;
+
+    if ((rc = mdb_put(db->txn, db->dbsid, &dbid, &dbstr, MDB_APPEND))
+        || (rc = mdb_put(db->txn, db->dbstr, &dbstr, &dbid, MDB_NOOVERWRITE)))
+    {
+        printf("Failed to write string: %d\n", rc);
+        return -1;
+    }
+
+    return 0;
+}
+
+int dbcompact(const char *key)
+{
+    // Facets hold most of the data, so their values are stored as string
+    // ids rather than repeating every filename
+    return strncmp(key, "has/", 4) == 0;
+}
+
+static MDB_dbi dbdbi(struct Database *db, char *key)
+{
+    return dbcompact(key) ? db->dbfid : db->dbfil;
+}
+
+static int dbvalue(struct Database *db, MDB_dbi dbi, MDB_val *dbdata, MDB_val *value)
+{
+    if (dbi != db->dbfid && dbi != db->dbidx)
+    {
+        *value = *dbdata;
+        return 0;
+    }
+
+    unsigned int id;
+    if (dbdata->mv_size != sizeof(id))
+        return -1;
 
-    // MDB_txn *txn;
-    // if ((rc = mdb_txn_begin(db->env, NULL, 0, &txn))) 
-    // {
-    //     printf("Failed to create transaction: %d\n", rc);
-    //     return -1;
-    // }
+    memcpy(&id, dbdata->mv_data, sizeof(id));
 
-    // MDB_cursor *cur;
-    // if ((rc = mdb_cursor_open(txn, db->dbstr, &cur)))
-    // {
-    //     printf("Failed to open cursor: %d\n", rc);
-    //     return -1;
-    // }
+    char *str;
+    if ((str = dbstrget(db, id)) == NULL)
+        return -1;
 
-    // MDB_val key = {sizeof(unsigned int), }
-    // rc = mdb_get(txn, db->dbstr, )
+    value->mv_size = strlen(str) + 1;
+    value->mv_data = str;
 
     return 0;
+}
+
+static int dbreved(MDB_val *dbkey)
+{
+    // Only favorites and facets tag a file. Recently played values start
+    // with a time, so they would only grow the index with one-off entries.
+    return dbkey->mv_size > 4
+        && (memcmp(dbkey->mv_data, "fav/", 4) == 0 || memcmp(dbkey->mv_data, "has/", 4) == 0);
+}
+
+static int dbrevput(struct Database *db, MDB_val *dbkey, MDB_val *dbdata, int del)
+{
+    if (!dbreved(dbkey))
+        return 0;
+
+    // The reverse database swaps key and data, so every key holding a
+    // value is one range read away
+    int rc;
+    if (del)
+        rc = mdb_del(db->txn, db->dbrev, dbdata, dbkey);
+    else
+        rc = mdb_put(db->txn, db->dbrev, dbdata, dbkey, MDB_NODUPDATA);
+
+    if (rc && rc != MDB_KEYEXIST && rc != MDB_NOTFOUND)
+    {
+        printf("Failed to write reverse data: %d\n", rc);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int dbcountrebuild(struct Database *db, MDB_dbi dbi)
+{
+    int rc;
+    MDB_cursor *cur;
+    if ((rc = mdb_cursor_open(db->txn, dbi, &cur)))
+    {
+        printf("Failed to open cursor: %d\n", rc);
+        return -1;
+    }
+
+    char key[BUFFER_SIZE];
+    MDB_val dbkey;
+    MDB_val dbdata;
+
+    int res = 0;
+    rc = mdb_cursor_get(cur, &dbkey, &dbdata, MDB_FIRST);
+    while (!rc && !res)
+    {
+        size_t count;
+        if (dbkey.mv_size > 0 && dbkey.mv_size <= BUFFER_SIZE && !mdb_cursor_count(cur, &count))
+        {
+            memcpy(key, dbkey.mv_data, dbkey.mv_size);
+            key[dbkey.mv_size - 1] = '\0';
+            res = dbcountadd(db, key, count);
+        }
+
+        rc = mdb_cursor_get(cur, &dbkey, &dbdata, MDB_NEXT_NODUP);
+    }
+
+    mdb_cursor_close(cur);
+
+    return res;
+}
+
+static int dbrevrebuild(void *arg, MDB_val *key, MDB_val *data)
+{
+    return dbrevput((struct Database *)arg, key, data, 0);
+}
+
+static int dbmigrate(struct Database *db)
+{
+    printf("Moving facets to file ids...\n");
+
+    int rc;
+    MDB_cursor *cur;
+    if ((rc = mdb_cursor_open(db->txn, db->dbfil, &cur)))
+    {
+        printf("Failed to open cursor: %d\n", rc);
+        return -1;
+    }
+
+    char key[BUFFER_SIZE];
+    char prefix[] = "has/";
+    MDB_val dbkey = {4, prefix};
+    MDB_val dbdata;
+    unsigned int id;
+    int res = 0;
+
+    rc = mdb_cursor_get(cur, &dbkey, &dbdata, MDB_SET_RANGE);
+    while (!rc && !res && dbcompact(dbkey.mv_data))
+    {
+        MDB_val dbid = {sizeof(id), &id};
+        if ((res = dbstrput(db, dbdata.mv_data, &id)) == 0
+            && (rc = mdb_put(db->txn, db->dbfid, &dbkey, &dbid, MDB_NODUPDATA)) && rc != MDB_KEYEXIST)
+        {
+            printf("Failed to write file id: %d\n", rc);
+            res = -1;
+        }
+
+        rc = mdb_cursor_get(cur, &dbkey, &dbdata, MDB_NEXT);
+    }
+
+    // Seeking again after each delete, since the cursor does not survive
+    // the pages changing under it
+    while (!res && !mdb_cursor_get(cur, &dbkey, &dbdata, MDB_SET_RANGE) && dbcompact(dbkey.mv_data))
+    {
+        if (dbkey.mv_size > BUFFER_SIZE)
+        {
+            res = -1;
+            break;
+        }
+
+        memcpy(key, dbkey.mv_data, dbkey.mv_size);
+        dbkey.mv_data = key;
+
+        if ((rc = mdb_del(db->txn, db->dbfil, &dbkey, NULL)))
+        {
+            printf("Failed to delete data: %d\n", rc);
+            res = -1;
+        }
+
+        dbkey.mv_size = 4;
+        dbkey.mv_data = prefix;
+    }
+
+    mdb_cursor_close(cur);
+
+    return res;
+}
+
+static int dbupgrade(struct Database *db)
+{
+    MDB_stat filstat;
+    MDB_stat fidstat;
+    MDB_stat cntstat;
+    MDB_stat slistat;
+    MDB_stat revstat;
+    if (mdb_stat(db->txn, db->dbfil, &filstat)
+        || mdb_stat(db->txn, db->dbfid, &fidstat)
+        || mdb_stat(db->txn, db->dbcnt, &cntstat)
+        || mdb_stat(db->txn, db->dbsli, &slistat)
+        || mdb_stat(db->txn, db->dbrev, &revstat))
+        return -1;
+
+    if (filstat.ms_entries + fidstat.ms_entries == 0)
+        return 0;
+
+    // Facets from before file ids are moved over once. Counts, slices
+    // and the reverse database are by string, so they carry over as is.
+    if (fidstat.ms_entries == 0 && dbmigrate(db))
+        return -1;
+
+    // Databases from before counts and slices were kept get them built
+    // once
+    if (cntstat.ms_entries == 0 || slistat.ms_entries == 0)
+    {
+        printf("Counting database entries...\n");
+
+        if (mdb_drop(db->txn, db->dbcnt, 0)
+            || mdb_drop(db->txn, db->dbsli, 0)
+            || dbcountrebuild(db, db->dbfil)
+            || dbcountrebuild(db, db->dbfid))
+            return -1;
+    }
+
+    if (revstat.ms_entries == 0)
+    {
+        printf("Indexing database values...\n");
+
+        // Only favorites and facets go in, so there is no need to walk
+        // anything else
+        char fav[] = "fav/";
+        char has[] = "has/";
+        if (dbeach(db, fav, 0, dbrevrebuild, db) || dbeach(db, has, 0, dbrevrebuild, db))
+            return -1;
+    }
+
+    return 0;
+}
+
+int dbput(struct Database *db, char *key, char *data)
+{
+    if (dbtxncheck(db))
+        return -1;
+
+    MDB_val dbkey = {strlen(key) + 1, key};
+    MDB_val dbdata = {strlen(data) + 1, data};
+    MDB_dbi dbi = dbdbi(db, key);
+
+    unsigned int id;
+    MDB_val dbid = {sizeof(id), &id};
+    if (dbi == db->dbfid && dbstrput(db, data, &id))
+        return -1;
+
+    int rc;
+    if ((rc = mdb_put(db->txn, dbi, &dbkey, dbi == db->dbfid ? &dbid : &dbdata, MDB_NODUPDATA)))
+    {
+        if (rc != MDB_KEYEXIST)
+        {
+            printf("Failed to write data: %d\n", rc);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if (dbrevput(db, &dbkey, &dbdata, 0))
+        return -1;
+
+    return dbcountadd(db, key, 1);
+}
+
+int dbdel(struct Database *db, char *key, char *data)
+{
+    if (dbtxncheck(db))
+        return -1;
+
+    MDB_val dbkey = {strlen(key) + 1, key};
+    MDB_val dbdata;
+    MDB_dbi dbi = dbdbi(db, key);
+
+    int rc;
+    if (data)
+    {
+        dbdata.mv_size = strlen(data) + 1;
+        dbdata.mv_data = data;
+
+        // A string without an id cannot be in any facet
+        unsigned int id;
+        MDB_val dbid = {sizeof(id), &id};
+        if (dbi == db->dbfid && dbstrid(db, data, &id))
+            return 0;
+
+        if ((rc = mdb_del(db->txn, dbi, &dbkey, dbi == db->dbfid ? &dbid : &dbdata)))
+        {
+            if (rc != MDB_NOTFOUND)
+            {
+                printf("Failed to delete data: %d\n", rc);
+                return -1;
+            }
+
+            return 0;
+        }
+
+        if (dbrevput(db, &dbkey, &dbdata, 1))
+            return -1;
+
+        return dbcountadd(db, key, -1);
+    }
+
+    // Deleting the whole key takes each of its values out of the reverse
+    // database and the counts
+    MDB_cursor *cur;
+    if ((rc = mdb_cursor_open(db->txn, dbi, &cur)))
+    {
+        printf("Failed to open cursor: %d\n", rc);
+        return -1;
+    }
+
+    long count = 0;
+    int res = 0;
+    MDB_val curkey = dbkey;
+    MDB_val value;
+    rc = mdb_cursor_get(cur, &curkey, &dbdata, MDB_SET);
+    while (!rc && !res)
+    {
+        if (!dbvalue(db, dbi, &dbdata, &value))
+            res = dbrevput(db, &dbkey, &value, 1);
+
+        count++;
+        rc = mdb_cursor_get(cur, &curkey, &dbdata, MDB_NEXT_DUP);
+    }
+
+    mdb_cursor_close(cur);
+
+    if (res)
+        return -1;
+
+    if (count == 0)
+        return 0;
+
+    if ((rc = mdb_del(db->txn, dbi, &dbkey, NULL)))
+    {
+        printf("Failed to delete data: %d\n", rc);
+        return -1;
+    }
+
+    return dbcountadd(db, key, -count);
+}
+
+int dbcurdel(struct Database *db)
+{
+    if (dbcurcheck(db))
+        return -1;
+
+    // Only for the filter cursor, so never a facet
+    int rc;
+    MDB_val dbkey;
+    MDB_val dbdata;
+    if ((rc = mdb_cursor_get(db->cur, &dbkey, &dbdata, MDB_GET_CURRENT)))
+    {
+        printf("Failed to read cursor: %d\n", rc);
+        return -1;
+    }
+
+    // The key is only valid until the delete
+    char key[BUFFER_SIZE];
+    if (dbkey.mv_size == 0 || dbkey.mv_size > BUFFER_SIZE)
+        return -1;
+
+    memcpy(key, dbkey.mv_data, dbkey.mv_size);
+    key[dbkey.mv_size - 1] = '\0';
+
+    if (dbrevput(db, &dbkey, &dbdata, 1))
+        return -1;
+
+    if ((rc = mdb_cursor_del(db->cur, 0)))
+    {
+        printf("Failed to delete data: %d\n", rc);
+        return -1;
+    }
+
+    return dbcountadd(db, key, -1);
+}
+
+int dbhas(struct Database *db, char *key, char *data)
+{
+    if (dbtxncheck(db))
+        return 0;
+
+    MDB_val dbkey = {strlen(key) + 1, key};
+    MDB_val dbdata = {strlen(data) + 1, data};
+    MDB_dbi dbi = dbdbi(db, key);
+
+    unsigned int id;
+    if (dbi == db->dbfid)
+    {
+        if (dbstrid(db, data, &id))
+            return 0;
+
+        dbdata.mv_size = sizeof(id);
+        dbdata.mv_data = &id;
+    }
+
+    int rc;
+    MDB_cursor *cur;
+    if ((rc = mdb_cursor_open(db->txn, dbi, &cur)))
+    {
+        printf("Failed to open cursor: %d\n", rc);
+        return 0;
+    }
+
+    int has = !mdb_cursor_get(cur, &dbkey, &dbdata, MDB_GET_BOTH);
+
+    mdb_cursor_close(cur);
+
+    return has;
+}
+
+static int dbeachdbi(struct Database *db, MDB_dbi dbi, char *prefix, int exact, db_each_t each, void *arg)
+{
+    int rc;
+    MDB_cursor *cur;
+    if ((rc = mdb_cursor_open(db->txn, dbi, &cur)))
+    {
+        printf("Failed to open cursor: %d\n", rc);
+        return -1;
+    }
+
+    size_t prefixlen = strlen(prefix);
+    MDB_val dbkey = {exact ? prefixlen + 1 : prefixlen, prefix};
+    MDB_val dbdata;
+    MDB_val value;
+
+    if (exact)
+        rc = mdb_cursor_get(cur, &dbkey, &dbdata, MDB_SET);
+    else if (prefixlen == 0)
+        rc = mdb_cursor_get(cur, &dbkey, &dbdata, MDB_FIRST);
+    else
+        rc = mdb_cursor_get(cur, &dbkey, &dbdata, MDB_SET_RANGE);
+
+    int res = 0;
+    while (!rc && !res)
+    {
+        if (dbkey.mv_size < prefixlen || memcmp(dbkey.mv_data, prefix, prefixlen) != 0)
+            break;
+
+        if (!dbvalue(db, dbi, &dbdata, &value))
+            res = each(arg, &dbkey, &value);
+
+        rc = mdb_cursor_get(cur, &dbkey, &dbdata, exact ? MDB_NEXT_DUP : MDB_NEXT);
+    }
+
+    mdb_cursor_close(cur);
+
+    return res;
+}
+
+int dbeach(struct Database *db, char *prefix, int exact, db_each_t each, void *arg)
+{
+    if (dbtxncheck(db))
+        return -1;
+
+    // Facets and everything else live apart, so both are walked. A
+    // callback returning non-zero stops the walk.
+    int res;
+    if ((res = dbeachdbi(db, db->dbfil, prefix, exact, each, arg)))
+        return res;
+
+    return dbeachdbi(db, db->dbfid, prefix, exact, each, arg);
+}
+
+int dbcount(struct Database *db, char *key, unsigned int *count)
+{
+    if (dbtxncheck(db))
+        return -1;
+
+    MDB_val dbkey = {strlen(key) + 1, key};
+    MDB_val dbdata;
+
+    *count = 0;
+    if (mdb_get(db->txn, db->dbcnt, &dbkey, &dbdata) == 0 && dbdata.mv_size == sizeof(*count))
+        memcpy(count, dbdata.mv_data, sizeof(*count));
+
+    return 0;
+}
+
+int dbchanged(struct Database *db, char *core, size_t since, db_str_t each, void *arg)
+{
+    if (dbtxncheck(db))
+        return -1;
+
+    // Classes of the core's keys written after since, with "*" for writes
+    // that could have touched anything
+    size_t txnid;
+    char all[] = "*";
+    MDB_val dbkey = {sizeof(all), all};
+    MDB_val dbdata;
+    int res;
+    if (!mdb_get(db->txn, db->dbchg, &dbkey, &dbdata) && dbdata.mv_size == sizeof(txnid))
+    {
+        memcpy(&txnid, dbdata.mv_data, sizeof(txnid));
+        if (txnid > since && (res = each(arg, all)))
+            return res;
+    }
+
+    char prefix[TOUCH_LEN];
+    int prefixlen = snprintf(prefix, TOUCH_LEN, "%s/", core);
+    if (prefixlen >= TOUCH_LEN)
+        return each(arg, all);
+
+    int rc;
+    MDB_cursor *cur;
+    if ((rc = mdb_cursor_open(db->txn, db->dbchg, &cur)))
+    {
+        printf("Failed to open cursor: %d\n", rc);
+        return -1;
+    }
+
+    dbkey.mv_size = prefixlen;
+    dbkey.mv_data = prefix;
+    rc = mdb_cursor_get(cur, &dbkey, &dbdata, MDB_SET_RANGE);
+
+    res = 0;
+    while (!rc && !res)
+    {
+        if (dbkey.mv_size <= (size_t)prefixlen + 1 || memcmp(dbkey.mv_data, prefix, prefixlen) != 0)
+            break;
+
+        if (dbdata.mv_size == sizeof(txnid))
+        {
+            memcpy(&txnid, dbdata.mv_data, sizeof(txnid));
+            if (txnid > since)
+                res = each(arg, (char *)dbkey.mv_data + prefixlen);
+        }
+
+        rc = mdb_cursor_get(cur, &dbkey, &dbdata, MDB_NEXT);
+    }
+
+    mdb_cursor_close(cur);
+
+    return res;
+}
+
+
+static int dbtrikey(char *core, const char *tri, char *key, size_t size)
+{
+    // Trigrams are lowercase, so matching ignores case
+    int len = snprintf(key, size, "%s/", core);
+    if (len < 0 || (size_t)len + TRI_LEN >= size)
+        return -1;
+
+    int i;
+    for (i = 0; i < TRI_LEN; i++)
+        key[len + i] = tolower((unsigned char)tri[i]);
+
+    key[len + TRI_LEN] = '\0';
+
+    return len + TRI_LEN + 1;
+}
+
+int dbindex(struct Database *db, char *core, char *name, int del)
+{
+    if (dbtxncheck(db))
+        return -1;
+
+    unsigned int id;
+    int res = del ? dbstrid(db, name, &id) : dbstrput(db, name, &id);
+    if (res)
+        return res < 0 ? -1 : 0;
+
+    MDB_val dbkey = {strlen(core) + 1, core};
+    MDB_val dbid = {sizeof(id), &id};
+
+    // The list of indexed names is what a short query falls back to, and
+    // what tells a later scan which names are already indexed. It is kept
+    // apart from the data, so it never shows up in counts or key listings.
+    int rc;
+    if (del)
+        rc = mdb_del(db->txn, db->dbidx, &dbkey, &dbid);
+    else
+        rc = mdb_put(db->txn, db->dbidx, &dbkey, &dbid, MDB_NODUPDATA);
+
+    if (rc && rc != MDB_KEYEXIST && rc != MDB_NOTFOUND)
+    {
+        printf("Failed to write index: %d\n", rc);
+        return -1;
+    }
+
+    char key[BUFFER_SIZE];
+    size_t namelen = strlen(name);
+    size_t i;
+    for (i = 0; i + TRI_LEN <= namelen; i++)
+    {
+        int keylen;
+        if ((keylen = dbtrikey(core, name + i, key, BUFFER_SIZE)) < 0)
+            return -1;
+
+        dbkey.mv_size = keylen;
+        dbkey.mv_data = key;
+
+        if (del)
+            rc = mdb_del(db->txn, db->dbtri, &dbkey, &dbid);
+        else
+            rc = mdb_put(db->txn, db->dbtri, &dbkey, &dbid, MDB_NODUPDATA);
+
+        if (rc && rc != MDB_KEYEXIST && rc != MDB_NOTFOUND)
+        {
+            printf("Failed to write trigram: %d\n", rc);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int dbindexed(struct Database *db, char *core, char *name)
+{
+    if (dbtxncheck(db))
+        return 0;
+
+    unsigned int id;
+    if (dbstrid(db, name, &id))
+        return 0;
+
+    MDB_val dbkey = {strlen(core) + 1, core};
+    MDB_val dbid = {sizeof(id), &id};
+
+    int rc;
+    MDB_cursor *cur;
+    if ((rc = mdb_cursor_open(db->txn, db->dbidx, &cur)))
+    {
+        printf("Failed to open cursor: %d\n", rc);
+        return 0;
+    }
+
+    int indexed = !mdb_cursor_get(cur, &dbkey, &dbid, MDB_GET_BOTH);
+
+    mdb_cursor_close(cur);
+
+    return indexed;
+}
+
+int dbindexeach(struct Database *db, char *core, db_str_t each, void *arg)
+{
+    if (dbtxncheck(db))
+        return -1;
+
+    int rc;
+    MDB_cursor *cur;
+    if ((rc = mdb_cursor_open(db->txn, db->dbidx, &cur)))
+    {
+        printf("Failed to open cursor: %d\n", rc);
+        return -1;
+    }
+
+    MDB_val dbkey = {strlen(core) + 1, core};
+    MDB_val dbdata;
+    MDB_val value;
+
+    int res = 0;
+    rc = mdb_cursor_get(cur, &dbkey, &dbdata, MDB_SET);
+    while (!rc && !res)
+    {
+        if (!dbvalue(db, db->dbidx, &dbdata, &value))
+            res = each(arg, value.mv_data);
+
+        rc = mdb_cursor_get(cur, &dbkey, &dbdata, MDB_NEXT_DUP);
+    }
+
+    mdb_cursor_close(cur);
+
+    return res;
+}
+
+int dbmatch(const char *str, const char *query)
+{
+    // Case-insensitive substring test, the same folding as the trigrams
+    for (; *str; str++)
+    {
+        const char *a = str;
+        const char *b = query;
+        while (*a && *b && tolower((unsigned char)*a) == tolower((unsigned char)*b))
+        {
+            a++;
+            b++;
+        }
+
+        if (!*b)
+            return 1;
+    }
+
+    return !*query;
+}
+
+struct SearchArgs
+{
+    char *query;
+    db_str_t each;
+    void *arg;
+};
+
+static int dbsearchmatch(void *arg, char *str)
+{
+    struct SearchArgs *args = (struct SearchArgs *)arg;
+
+    if (!dbmatch(str, args->query))
+        return 0;
+
+    return args->each(args->arg, str);
+}
+
+static int dbsearchjoin(struct Database *db, MDB_cursor **curs, MDB_val *keys, int count, struct SearchArgs *args)
+{
+    MDB_val key = keys[0];
+    MDB_val data;
+    if (mdb_cursor_get(curs[0], &key, &data, MDB_SET))
+        return 0;
+
+    // Leapfrog join over the posting lists, the same as the facet
+    // intersections in peekfs. Every match is checked against the query,
+    // since trigrams in a name don't have to be next to each other.
+    MDB_val candidate = data;
+    MDB_val value;
+    int agreed = 1;
+    int k = 0;
+    int res = 0;
+    while (!res)
+    {
+        if (agreed == count)
+        {
+            if (!dbvalue(db, db->dbfid, &candidate, &value))
+                res = dbsearchmatch(args, value.mv_data);
+
+            if (res || mdb_cursor_get(curs[k], &key, &data, MDB_NEXT_DUP))
+                break;
+
+            candidate = data;
+            agreed = 1;
+            continue;
+        }
+
+        k = (k + 1) % count;
+        key = keys[k];
+        data = candidate;
+        if (mdb_cursor_get(curs[k], &key, &data, MDB_GET_BOTH_RANGE))
+            break;
+
+        if (mdb_dcmp(db->txn, db->dbtri, &data, &candidate) == 0)
+        {
+            agreed++;
+        }
+        else
+        {
+            candidate = data;
+            agreed = 1;
+        }
+    }
+
+    return res;
+}
+
+int dbsearch(struct Database *db, char *core, char *query, db_str_t each, void *arg)
+{
+    if (dbtxncheck(db))
+        return -1;
+
+    struct SearchArgs args = { query, each, arg };
+
+    // Too short for a trigram, so every indexed name is checked
+    size_t querylen = strlen(query);
+    if (querylen < TRI_LEN)
+        return dbindexeach(db, core, dbsearchmatch, &args);
+
+    // Spread the trigrams over the whole query, which narrows it down as
+    // much as all of them would in practice
+    char keybuf[TRI_MAX * (BUFFER_SIZE / TRI_MAX)];
+    MDB_val keys[TRI_MAX];
+    int count = querylen - TRI_LEN + 1;
+    if (count > TRI_MAX)
+        count = TRI_MAX;
+
+    size_t keysize = sizeof(keybuf) / TRI_MAX;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        size_t offset = (count > 1) ? i * (querylen - TRI_LEN) / (count - 1) : 0;
+
+        int keylen;
+        if ((keylen = dbtrikey(core, query + offset, keybuf + i * keysize, keysize)) < 0)
+            return -1;
+
+        keys[i].mv_size = keylen;
+        keys[i].mv_data = keybuf + i * keysize;
+    }
+
+    int rc = 0;
+    int res = 0;
+    MDB_cursor *curs[TRI_MAX];
+
+    int opened;
+    for (opened = 0; opened < count; opened++)
+    {
+        if ((rc = mdb_cursor_open(db->txn, db->dbtri, &curs[opened])))
+        {
+            printf("Failed to open cursor: %d\n", rc);
+            res = -1;
+            break;
+        }
+    }
+
+    if (!res)
+        res = dbsearchjoin(db, curs, keys, count, &args);
+
+    for (i = 0; i < opened; i++)
+        mdb_cursor_close(curs[i]);
+
+    return res;
 }
\ No newline at end of file
@@ -1,26 +1,65 @@
 #include <lmdb.h>
 
+// Classes of keys a write transaction changed, such as NES/fav
+#define TOUCH_MAX 16
+#define TOUCH_LEN 64
+
 struct Database
 {
     struct MDB_env *env;
     MDB_dbi dbfil;
+    MDB_dbi dbfid;
     MDB_dbi dbstr;
+    MDB_dbi dbsid;
+    MDB_dbi dbcnt;
+    MDB_dbi dbsli;
+    MDB_dbi dbrev;
+    MDB_dbi dbtri;
+    MDB_dbi dbidx;
+    MDB_dbi dbchg;
     MDB_txn *txn;
     int txnreadonly;
     MDB_cursor *cur;
+    MDB_txn *rdtxn;
+    MDB_cursor *rdcur;
+    char touched[TOUCH_MAX][TOUCH_LEN];
+    int touchedlen;
+    int touchedall;
 };
 
 #define TIME_LEN 8
 
+#define TRI_LEN 3
+#define TRI_MAX 16
+
+typedef int (*db_each_t)(void *arg, MDB_val *key, MDB_val *data);
+typedef int (*db_str_t)(void *arg, char *str);
+
 int dbopen(struct Database *db);
 void dbclose(struct Database *db);
+char *dbpath(void);
+int dbsetpath(const char *path, size_t mapsize);
+int dbclone(struct Database *db, struct Database *src);
+void dbreaderclose(struct Database *db);
 int dbtxnopen(struct Database *db, int readonly);
 int dbtxncheck(struct Database *db);
 int dbtxnclose(struct Database *db);
 int dbcuropen(struct Database *db);
 int dbcurcheck(struct Database *db);
 int dbcurclose(struct Database *db);
+int dbcompact(const char *key);
 int dbput(struct Database *db, char *key, char *data);
 int dbdel(struct Database *db, char *key, char *data);
-int dbstrget(struct Database *db, char *str, unsigned int id);
+int dbcurdel(struct Database *db);
+int dbhas(struct Database *db, char *key, char *data);
+int dbeach(struct Database *db, char *prefix, int exact, db_each_t each, void *arg);
+int dbcount(struct Database *db, char *key, unsigned int *count);
+int dbchanged(struct Database *db, char *core, size_t since, db_str_t each, void *arg);
+int dbindex(struct Database *db, char *core, char *name, int del);
+int dbindexed(struct Database *db, char *core, char *name);
+int dbindexeach(struct Database *db, char *core, db_str_t each, void *arg);
+int dbmatch(const char *str, const char *query);
+int dbsearch(struct Database *db, char *core, char *query, db_str_t each, void *arg);
+char *dbstrget(struct Database *db, unsigned int id);
+int dbstrid(struct Database *db, char *str, unsigned int *id);
 int dbstrput(struct Database *db, char *str, unsigned int *id);
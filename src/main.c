@@ -17,6 +17,7 @@
 #include <time.h>
 #include <db.h>
 #include <path.h>
+#include "warmup.h"
 
 // Path for games directory
 #define GAMES_PATH "/media/fat/games"
@@ -40,6 +41,13 @@ struct Portal
     int retry;
 };
 
+// A Peek folder the service mounted, taken down again when it stops
+struct Mounted
+{
+    struct Mounted *next;
+    char path[];
+};
+
 struct Notify
 {
     int id;
@@ -55,8 +63,10 @@ static char *_portalpath;
 static char *_peekfspath;
 static char *_core;
 static char *_rom;
-static char *_peekmountpath;
+static struct Mounted *_peekmounts;
 static struct Database _db;
+static struct Warmup _warmup;
+static size_t _warmupbudget;
 
 void shutdown()
 {
@@ -159,7 +169,7 @@ void updaterecents()
                 {
                     if (count >= MAX_RECENTS || dbdata.mv_size < TIME_LEN + 1 || strcmp(_rom, dbdata.mv_data + TIME_LEN) == 0)
                     {
-                        mdb_cursor_del(_db.cur, 0);
+                        dbcurdel(&_db);
                     }
                     else
                     {
@@ -299,39 +309,51 @@ void runcmd_bproc(char *path)
     }
 }
 
+int runcmd_dbget_each(void *arg, MDB_val *key, MDB_val *data)
+{
+    (void) key;
+
+    struct Portal *portal = (struct Portal *)arg;
+
+    printf("Data: %s\n", (char *)data->mv_data);
+    writestr(portal, (char *)data->mv_data);
+
+    return 0;
+}
+
 void runcmd_dbget(struct Portal *portal, char *cmdkey, char *key)
 {
     if (!dbtxnopen(&_db, 1))
     {
-        int rc;
+        writestr(portal, cmdkey);
 
-        if (!dbcuropen(&_db))
-        {
-            MDB_val dbkey = {strlen(key) + 1, key};
-            MDB_val dbdata;
+        dbeach(&_db, key, 1, runcmd_dbget_each, portal);
 
-            writestr(portal, cmdkey);
+        writeeom(portal);
 
-            if ((rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_SET)))
-            {
-                printf("No data found: %d\n", rc);
-            }
-            else
-            {
-                printf("Data found!\n");
+        dbtxnclose(&_db);
+    }
+}
 
-                do
-                {
-                    printf("Data: %s\n", (char *)dbdata.mv_data);
-                    writestr(portal, (char *)dbdata.mv_data);
-                }
-                while (!(rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_NEXT)));
-            }
+int runcmd_dbsearch_each(void *arg, char *str)
+{
+    struct Portal *portal = (struct Portal *)arg;
 
-            writeeom(portal);
+    printf("Match: %s\n", str);
+    writestr(portal, str);
 
-            dbcurclose(&_db);
-        }
+    return 0;
+}
+
+void runcmd_dbsearch(struct Portal *portal, char *cmdkey, char *core, char *query)
+{
+    if (!dbtxnopen(&_db, 1))
+    {
+        writestr(portal, cmdkey);
+
+        dbsearch(&_db, core, query, runcmd_dbsearch_each, portal);
+
+        writeeom(portal);
 
         dbtxnclose(&_db);
     }
@@ -343,15 +365,16 @@ void runcmd_dbkeys(struct Portal *portal, char *cmdkey, char *value)
     {
         int rc;
 
-        if (!dbcuropen(&_db))
+        MDB_cursor *cur;
+        if (!(rc = mdb_cursor_open(_db.txn, _db.dbrev, &cur)))
         {
-            MDB_val dbkey;
-            MDB_val dbdata;
             MDB_val dbvalue = {strlen(value) + 1, value};
+            MDB_val dbkey;
 
             writestr(portal, cmdkey);
 
-            if ((rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_FIRST)))
+            // The reverse database lists every key holding the value
+            if ((rc = mdb_cursor_get(cur, &dbvalue, &dbkey, MDB_SET)))
             {
                 printf("No data found: %d\n", rc);
             }
@@ -361,18 +384,19 @@ void runcmd_dbkeys(struct Portal *portal, char *cmdkey, char *value)
 
                 do
                 {
-                    if (!(rc = mdb_cursor_get(_db.cur, &dbkey, &dbvalue, MDB_GET_BOTH)))
-                    {
-                        printf("Data: %s\n", (char *)dbkey.mv_data);
-                        writestr(portal, (char *)dbkey.mv_data);
-                    }
+                    printf("Data: %s\n", (char *)dbkey.mv_data);
+                    writestr(portal, (char *)dbkey.mv_data);
                 }
-                while (!(rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_NEXT_NODUP)));
+                while (!(rc = mdb_cursor_get(cur, &dbvalue, &dbkey, MDB_NEXT_DUP)));
             }
 
             writeeom(portal);
 
-            dbcurclose(&_db);
+            mdb_cursor_close(cur);
+        }
+        else
+        {
+            printf("Failed to open cursor: %d\n", rc);
         }
 
         dbtxnclose(&_db);
@@ -383,28 +407,9 @@ void runcmd_dbchk(struct Portal *portal, char *cmdkey, char *key, char *data)
 {
     if (!dbtxnopen(&_db, 1))
     {
-        int rc;
-
-        if (!dbcuropen(&_db))
-        {
-            MDB_val dbkey = {strlen(key) + 1, key};
-            MDB_val dbdata = {strlen(data) + 1, data};
-
-            writestr(portal, cmdkey);
-
-            if ((rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_GET_BOTH)))
-            {
-                writestr(portal, "0");
-            }
-            else
-            {
-                writestr(portal, "1");
-            }
-
-            writeeom(portal);
-
-            dbcurclose(&_db);
-        }
+        writestr(portal, cmdkey);
+        writestr(portal, dbhas(&_db, key, data) ? "1" : "0");
+        writeeom(portal);
 
         dbtxnclose(&_db);
     }
@@ -474,6 +479,17 @@ void runcmd(struct Portal *portal)
 
         runcmd_dbget(portal, stack[0], stack[2]);
     }
+    else if (strcmp(stack[1], "dbsearch") == 0)
+    {
+        // Get file names matching a query
+        if (count < 4)
+        {
+            printf("'dbsearch' command requires four arguments\n");
+            return;
+        }
+
+        runcmd_dbsearch(portal, stack[0], stack[2], stack[3]);
+    }
     else if (strcmp(stack[1], "dbkeys") == 0)
     {
         // Get database keys for value
@@ -527,21 +543,39 @@ void runcmd(struct Portal *portal)
 
 void peekunmount()
 {
-    if (!_peekmountpath)
-        return;
+    // Only the folders mounted here are taken down, anything else the
+    // daemon serves is left alone
+    while (_peekmounts)
+    {
+        struct Mounted *mounted = _peekmounts;
+        _peekmounts = mounted->next;
+
+        printf("Unmounting: %s\n", mounted->path);
+
+        char procbuf[BUFFER_SIZE];
+        snprintf(procbuf, BUFFER_SIZE, "%s --unmount '%s'", _peekfspath, mounted->path);
 
-    printf("Unmounting: %s\n", _peekmountpath);
+        FILE *proc;
+        if ((proc = popen(procbuf, "r")) == NULL)
+        {
+            printf("Failed to open unmount process\n");
+        }
+        else
+        {
+            while (fgets(procbuf, BUFFER_SIZE, proc) != NULL)
+            {
+                // Don't care about the output
+            }
 
-    umount(_peekmountpath);
+            pclose(proc);
+        }
 
-    free(_peekmountpath);
-    _peekmountpath = (char *)NULL;
+        free(mounted);
+    }
 }
 
 void peekmount(char *romspath)
 {
-    peekunmount();
-
     char *path = malloc(strlen(romspath) + strlen(MOUNT_NAME) + 2);
     sprintf(path, "%s/%s", romspath, MOUNT_NAME);
 
@@ -587,13 +621,23 @@ void peekmount(char *romspath)
         }
     }
 
-    if (res != 0)
+    // Folders of earlier cores stay mounted, and each is remembered once
+    // so it can be unmounted when the service stops
+    struct Mounted *mounted;
+    for (mounted = _peekmounts; mounted; mounted = mounted->next)
     {
-        free(path);
-        return;
+        if (strcmp(mounted->path, path) == 0)
+            break;
+    }
+
+    if (res == 0 && !mounted && (mounted = malloc(sizeof(struct Mounted) + strlen(path) + 1)))
+    {
+        strcpy(mounted->path, path);
+        mounted->next = _peekmounts;
+        _peekmounts = mounted;
     }
 
-    _peekmountpath = path;
+    free(path);
 }
 
 void readrom(struct Portal *portal, char *rom)
@@ -616,6 +660,73 @@ void readrom(struct Portal *portal, char *rom)
     writeeom(portal);
 }
 
+struct WarmupArgs
+{
+    char *names[WARMUP_ROMS];
+    int count;
+    int limit;
+    int skip;
+};
+
+int warmupcore_each(void *arg, MDB_val *key, MDB_val *data)
+{
+    (void) key;
+
+    struct WarmupArgs *args = (struct WarmupArgs *)arg;
+    if (data->mv_size <= (size_t)args->skip + 1)
+        return 0;
+
+    char *name = (char *)data->mv_data + args->skip;
+
+    // Favorites are often played recently too
+    for (int i = 0; i < args->count; i++)
+    {
+        if (strcmp(args->names[i], name) == 0)
+            return 0;
+    }
+
+    if ((args->names[args->count] = strdup(name)) != NULL)
+        args->count++;
+
+    return args->count >= args->limit;
+}
+
+void warmupcore(char *romspath)
+{
+    struct WarmupArgs args;
+    args.count = 0;
+
+    char key[BUFFER_SIZE];
+    if (!dbtxnopen(&_db, 1))
+    {
+        // Recents are sorted newest first
+        sprintf(key, "rec/%s", _core);
+        args.limit = WARMUP_RECENTS;
+        args.skip = TIME_LEN;
+        dbeach(&_db, key, 1, warmupcore_each, &args);
+
+        sprintf(key, "fav/%s", _core);
+        args.limit = WARMUP_ROMS;
+        args.skip = 0;
+        dbeach(&_db, key, 1, warmupcore_each, &args);
+
+        dbtxnclose(&_db);
+    }
+
+    if (args.count > 0)
+    {
+        printf("Warming %d ROMs\n", args.count);
+        warmupstart(&_warmup, romspath, args.names, args.count);
+    }
+    else
+    {
+        warmupcancel(&_warmup);
+    }
+
+    for (int i = 0; i < args.count; i++)
+        free(args.names[i]);
+}
+
 void readcore(struct Notify *notify)
 {
     FILE *file;
@@ -635,8 +746,6 @@ void readcore(struct Notify *notify)
 
             if (strlen(_core) > 0)
                 free(_core);
-            
-            peekunmount();
 
             _core = malloc(strlen(core) + 1);
             strcpy(_core, core);
@@ -667,10 +776,12 @@ void readcore(struct Notify *notify)
                 }
 
                 peekmount(romspath);
+                warmupcore(romspath);
             }
             else
             {
                 printf("ROM path does not exist\n");
+                warmupcancel(&_warmup);
             }
 
             writestr(notify->portal, "core");
@@ -951,9 +1062,13 @@ void notifyframe(struct Notify *notify)
             }
             else if (notify->watchroms && event->wd == notify->watchroms)
             {
-                if (event->len > 0 && !checkrom(event->name))
+                // Opens by the warmup show up here as well
+                if (event->len > 0 && !warmupowned(&_warmup, event->name) && !checkrom(event->name))
                 {
                     printf("Game opened: %s\n", event->name);
+
+                    // Leave the disk to the game being loaded
+                    warmupcancel(&_warmup);
                     readrom(notify->portal, event->name);
                 }
             }
@@ -1040,18 +1155,22 @@ int initialize()
 	_terminated = 0;
     _core = "";
     _rom = "";
-    _peekmountpath = (char *)NULL;
+    _peekmounts = NULL;
 
     if (dbopen(&_db))
         return -1;
 
     _peekfspath = pathmake("peekfs");
 
+    if (_warmupbudget > 0 && warmupopen(&_warmup, _warmupbudget))
+        return -1;
+
     return 0;
 }
 
 void cleanup()
 {
+    warmupclose(&_warmup);
     peekunmount();
     dbclose(&_db);
 }
@@ -1061,6 +1180,7 @@ int main_service(int argc, char *argv[])
     printf("Starting service...\n");
 
     _portalpath = (argc > 2) ? argv[2] : "/dev/peek-screen";
+    _warmupbudget = (size_t)((argc > 3) ? strtoul(argv[3], NULL, 10) : WARMUP_BUDGET) * 1024 * 1024;
 
 	if (initialize())
 		return 1;
@@ -1081,48 +1201,63 @@ int main_service(int argc, char *argv[])
 	return 0;
 }
 
+struct PrefixArgs
+{
+    int found;
+    int delete;
+    char **keys;
+    int count;
+    int size;
+};
+
+int main_db_each(void *arg, MDB_val *key, MDB_val *data)
+{
+    struct PrefixArgs *args = (struct PrefixArgs *)arg;
+
+    if (!args->found)
+        printf("Data found!\n");
+
+    args->found = 1;
+    printf("Data: %s --- %s\n", (char *)key->mv_data, (char *)data->mv_data);
+
+    // Keys are deleted after the walk, since deleting would move the
+    // cursor out from under it
+    if (args->delete && (args->count == 0 || strcmp(args->keys[args->count - 1], key->mv_data) != 0))
+    {
+        if (args->count == args->size)
+        {
+            int size = args->size ? args->size * 2 : 64;
+            char **keys = realloc(args->keys, size * sizeof(char *));
+            if (!keys)
+                return -1;
+
+            args->keys = keys;
+            args->size = size;
+        }
+
+        if ((args->keys[args->count] = strdup(key->mv_data)) == NULL)
+            return -1;
+
+        args->count++;
+    }
+
+    return 0;
+}
+
 int main_db_get(int argc, char *argv[])
 {
+    char all[] = "";
     char *key = (argc > 3) ? argv[3] : (char *)NULL;
 
     if (!dbtxnopen(&_db, 1))
     {
-        int rc;
-        if (!dbcuropen(&_db))
-        {
-            MDB_val dbkey;
-            MDB_val dbdata;
-            MDB_cursor_op op;
-
-            if (key)
-            {
-                dbkey.mv_size = strlen(key) + 1;
-                dbkey.mv_data = key;
-                rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_SET);
-                op = MDB_NEXT_DUP;
-            }
-            else
-            {
-                rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_FIRST);
-                op = MDB_NEXT;
-            }
+        struct PrefixArgs args;
+        memset(&args, 0, sizeof(args));
 
-            if (rc)
-            {
-                printf("No data found: %d\n", rc);
-            }
-            else
-            {
-                printf("Data found!\n");
-                do
-                {
-                    printf("Data: %s --- %s\n", (char *)dbkey.mv_data, (char *)dbdata.mv_data);
-                }
-                while (!(rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, op)));
-            }
+        dbeach(&_db, key ? key : all, key != NULL, main_db_each, &args);
 
-            dbcurclose(&_db);
-        }
+        if (!args.found)
+            printf("No data found\n");
 
         dbtxnclose(&_db);
     }
@@ -1139,17 +1274,52 @@ int main_db_pre(int argc, char *argv[], int delete)
     }
 
     char *prefix = argv[3];
-    size_t prefixlen = strlen(prefix);
 
     if (!dbtxnopen(&_db, delete ? 0 : 1))
+    {
+        struct PrefixArgs args;
+        memset(&args, 0, sizeof(args));
+        args.delete = delete;
+
+        dbeach(&_db, prefix, 0, main_db_each, &args);
+
+        if (!args.found)
+            printf("No data found\n");
+
+        int i;
+        for (i = 0; i < args.count; i++)
+        {
+            dbdel(&_db, args.keys[i], NULL);
+            free(args.keys[i]);
+        }
+
+        free(args.keys);
+
+        dbtxnclose(&_db);
+    }
+
+    return 0;
+}
+
+int main_db_sli_level(char *prefix, size_t prefixlen)
+{
+    if (prefixlen >= BUFFER_SIZE)
+        return 1;
+
+    char parent[BUFFER_SIZE];
+    memcpy(parent, prefix, prefixlen - 1);
+    parent[prefixlen - 1] = '\0';
+
+    if (!dbtxnopen(&_db, 1))
     {
         int rc;
-        if (!dbcuropen(&_db))
+        MDB_cursor *cur;
+        if (!(rc = mdb_cursor_open(_db.txn, _db.dbsli, &cur)))
         {
-            MDB_val dbkey = {prefixlen + 1, prefix};
+            MDB_val dbkey = {prefixlen, parent};
             MDB_val dbdata;
 
-            rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_SET_RANGE);
+            rc = mdb_cursor_get(cur, &dbkey, &dbdata, MDB_SET);
             if (rc)
             {
                 printf("No data found: %d\n", rc);
@@ -1159,18 +1329,16 @@ int main_db_pre(int argc, char *argv[], int delete)
                 printf("Data found!\n");
                 do
                 {
-                    if (prefixlen > dbkey.mv_size || memcmp(prefix, dbkey.mv_data, prefixlen) != 0)
-                        break;
-
-                    printf("Data: %s --- %s\n", (char *)dbkey.mv_data, (char *)dbdata.mv_data);
-
-                    if (delete)
-                        mdb_cursor_del(_db.cur, 0);
+                    printf("%s\n", (char *)dbdata.mv_data);
                 }
-                while (!(rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_NEXT)));
+                while (!(rc = mdb_cursor_get(cur, &dbkey, &dbdata, MDB_NEXT_DUP)));
             }
 
-            dbcurclose(&_db);
+            mdb_cursor_close(cur);
+        }
+        else
+        {
+            printf("Failed to open cursor: %d\n", rc);
         }
 
         dbtxnclose(&_db);
@@ -1179,6 +1347,44 @@ int main_db_pre(int argc, char *argv[], int delete)
     return 0;
 }
 
+struct SliceArgs
+{
+    size_t prefixlen;
+    char slice[BUFFER_SIZE];
+    size_t slicelen;
+    int found;
+};
+
+int main_db_sli_each(void *arg, MDB_val *key, MDB_val *data)
+{
+    (void) data;
+
+    struct SliceArgs *args = (struct SliceArgs *)arg;
+
+    char *curstart = (char *)key->mv_data + args->prefixlen;
+    char *curend = strchr(curstart, '/');
+    size_t curlen = curend ? (size_t)(curend - curstart) : (key->mv_size - 1 - args->prefixlen);
+
+    if (curlen >= BUFFER_SIZE)
+        return 0;
+
+    if (!args->found)
+        printf("Data found!\n");
+
+    args->found = 1;
+
+    if (args->slicelen != curlen || memcmp(args->slice, curstart, curlen) != 0)
+    {
+        memcpy(args->slice, curstart, curlen);
+        args->slice[curlen] = '\0';
+        args->slicelen = curlen;
+
+        printf("%s\n", args->slice);
+    }
+
+    return 0;
+}
+
 int main_db_sli(int argc, char *argv[])
 {
     if (argc < 4)
@@ -1189,48 +1395,21 @@ int main_db_sli(int argc, char *argv[])
 
     char *prefix = argv[3];
     size_t prefixlen = strlen(prefix);
-    char slice[BUFFER_SIZE];
-    size_t slicelen = 0;
+
+    // A whole level is read straight from the slice database
+    if (prefixlen > 1 && prefix[prefixlen - 1] == '/')
+        return main_db_sli_level(prefix, prefixlen);
 
     if (!dbtxnopen(&_db, 1))
     {
-        int rc;
-        if (!dbcuropen(&_db))
-        {
-            MDB_val dbkey = {prefixlen + 1, prefix};
-            MDB_val dbdata;
-
-            rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_SET_RANGE);
-            if (rc)
-            {
-                printf("No data found: %d\n", rc);
-            }
-            else
-            {
-                printf("Data found!\n");
-                do
-                {
-                    if (prefixlen > dbkey.mv_size || memcmp(prefix, dbkey.mv_data, prefixlen) != 0)
-                        break;
-                    
-                    char *curstart = (char *)dbkey.mv_data + prefixlen;
-                    char *curend = strchr(curstart, '/');
-                    size_t curlen = curend ? (size_t)(curend - curstart) : (dbkey.mv_size - 1 - prefixlen);
-
-                    if (slicelen != curlen || memcmp(slice, curstart, slicelen) != 0)
-                    {
-                        memcpy(slice, curstart, curlen);
-                        slice[curlen] = '\0';
-                        slicelen = curlen;
+        struct SliceArgs args;
+        memset(&args, 0, sizeof(args));
+        args.prefixlen = prefixlen;
 
-                        printf("%s\n", slice);
-                    }
-                }
-                while (!(rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_NEXT)));
-            }
+        dbeach(&_db, prefix, 0, main_db_sli_each, &args);
 
-            dbcurclose(&_db);
-        }
+        if (!args.found)
+            printf("No data found\n");
 
         dbtxnclose(&_db);
     }
@@ -1295,13 +1474,13 @@ int main_db_keys(int argc, char *argv[])
     if (!dbtxnopen(&_db, 1))
     {
         int rc;
-        if (!dbcuropen(&_db))
+        MDB_cursor *cur;
+        if (!(rc = mdb_cursor_open(_db.txn, _db.dbrev, &cur)))
         {
-            MDB_val dbkey;
-            MDB_val dbdata;
             MDB_val dbvalue = {strlen(value) + 1, value};
+            MDB_val dbkey;
 
-            rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_FIRST);
+            rc = mdb_cursor_get(cur, &dbvalue, &dbkey, MDB_SET);
 
             if (rc)
             {
@@ -1312,15 +1491,16 @@ int main_db_keys(int argc, char *argv[])
                 printf("Data found!\n");
                 do
                 {
-                    if (!(rc = mdb_cursor_get(_db.cur, &dbkey, &dbvalue, MDB_GET_BOTH)))
-                    {
-                        printf("Data: %s\n", (char *)dbkey.mv_data);
-                    }
+                    printf("Data: %s\n", (char *)dbkey.mv_data);
                 }
-                while (!(rc = mdb_cursor_get(_db.cur, &dbkey, &dbdata, MDB_NEXT_NODUP)));
+                while (!(rc = mdb_cursor_get(cur, &dbvalue, &dbkey, MDB_NEXT_DUP)));
             }
 
-            dbcurclose(&_db);
+            mdb_cursor_close(cur);
+        }
+        else
+        {
+            printf("Failed to open cursor: %d\n", rc);
         }
 
         dbtxnclose(&_db);
@@ -1329,6 +1509,33 @@ int main_db_keys(int argc, char *argv[])
     return 0;
 }
 
+int main_db_search_each(void *arg, char *str)
+{
+    (void) arg;
+
+    printf("Data: %s\n", str);
+
+    return 0;
+}
+
+int main_db_search(int argc, char *argv[])
+{
+    if (argc < 5)
+    {
+        printf("Search command requires core and query\n");
+        return 1;
+    }
+
+    if (!dbtxnopen(&_db, 1))
+    {
+        dbsearch(&_db, argv[3], argv[4], main_db_search_each, NULL);
+
+        dbtxnclose(&_db);
+    }
+
+    return 0;
+}
+
 void main_db_import_put(char *core, char *rom, char *has, char *value)
 {
     if (strlen(value) == 0)
@@ -1340,12 +1547,30 @@ void main_db_import_put(char *core, char *rom, char *has, char *value)
     char *bit;
     for (bit = strtokplus(value, '|', &r); bit != NULL; bit = strtokplus(NULL, '|', &r))
     {
-        if (strlen(bit) == 0)
+        // Empty, or only slashes, which would leave no level to put it in
+        if (bit[strspn(bit, "/")] == '\0')
             continue;
 
         printf(" - %s: %s\n", has, bit);
 
-        sprintf(key, "has/%s/%s/%s", core, has, bit);
+        // A slash in a value nests it, so "Nintendo/EAD" becomes a folder
+        // inside "Nintendo". Empty levels are dropped.
+        int len = snprintf(key, BUFFER_SIZE, "has/%s/%s", core, has);
+
+        char *lr = NULL;
+        char *level;
+        for (level = strtokplus(bit, '/', &lr); level != NULL && len < BUFFER_SIZE; level = strtokplus(NULL, '/', &lr))
+        {
+            if (strlen(level) > 0)
+                len += snprintf(key + len, BUFFER_SIZE - len, "/%s", level);
+        }
+
+        if (len >= BUFFER_SIZE)
+        {
+            printf("Key too long, skipping\n");
+            continue;
+        }
+
         dbput(&_db, key, rom);
     }
 }
@@ -1472,6 +1697,10 @@ int main_db(int argc, char *argv[])
     {
         res = main_db_keys(argc, argv);
     }
+    else if (strcmp(cmd, "search") == 0)
+    {
+        res = main_db_search(argc, argv);
+    }
     else if (strcmp(cmd, "put") == 0)
     {
         res = main_db_put(argc, argv);
@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "warmup.h"
+
+// Not exported by libc, see ioprio_set(2)
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+static void warmupfree(char *path, char **names, int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+        free(names[i]);
+
+    free(names);
+    free(path);
+}
+
+static void warmupdisown(struct Warmup *warmup)
+{
+    struct WarmupOwned *owned = warmup->owned;
+    while (owned)
+    {
+        struct WarmupOwned *next = owned->next;
+        free(owned);
+        owned = next;
+    }
+
+    warmup->owned = NULL;
+}
+
+// Whether the job is still wanted, called with the lock held
+static int warmuplive(struct Warmup *warmup, unsigned int gen)
+{
+    return !warmup->stopping && warmup->gen == gen;
+}
+
+static int warmupcheck(struct Warmup *warmup, unsigned int gen)
+{
+    pthread_mutex_lock(&warmup->lock);
+    int live = warmuplive(warmup, gen);
+    pthread_mutex_unlock(&warmup->lock);
+
+    return live;
+}
+
+static void warmupown(struct Warmup *warmup, unsigned int gen, const char *name)
+{
+    size_t len = strlen(name) + 1;
+    struct WarmupOwned *owned = malloc(sizeof(struct WarmupOwned) + len);
+    if (!owned)
+        return;
+
+    memcpy(owned->name, name, len);
+
+    pthread_mutex_lock(&warmup->lock);
+
+    // A cancel doesn't stop the event from coming, but a core switch moves
+    // the watch away from the folder
+    if (warmup->owner == gen)
+    {
+        owned->next = warmup->owned;
+        warmup->owned = owned;
+        owned = NULL;
+    }
+
+    pthread_mutex_unlock(&warmup->lock);
+
+    free(owned);
+}
+
+static int warmupdrop(struct Warmup *warmup, const char *name)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&warmup->lock);
+
+    struct WarmupOwned **link;
+    for (link = &warmup->owned; *link; link = &(*link)->next)
+    {
+        if (strcmp((*link)->name, name) == 0)
+        {
+            struct WarmupOwned *owned = *link;
+            *link = owned->next;
+            free(owned);
+            found = 1;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&warmup->lock);
+
+    return found;
+}
+
+static void warmuprun(struct Warmup *warmup, unsigned int gen, char *path, char **names, int count)
+{
+    char filepath[4096];
+    size_t left = warmup->budget;
+
+    int i;
+    for (i = 0; i < count && left > 0; i++)
+    {
+        // Every ROM gets an even share of what is left, so small ones leave
+        // more for the rest
+        size_t share = left / (count - i);
+
+        if (snprintf(filepath, sizeof(filepath), "%s/%s", path, names[i]) >= (int)sizeof(filepath))
+            continue;
+
+        struct stat st;
+        if (stat(filepath, &st) || !S_ISREG(st.st_mode))
+            continue;
+
+        if (!warmupcheck(warmup, gen))
+            return;
+
+        // Owned before the open, since the event may be handled before
+        // open returns
+        warmupown(warmup, gen, names[i]);
+
+        int fd;
+        if ((fd = open(filepath, O_RDONLY)) < 0)
+        {
+            warmupdrop(warmup, names[i]);
+            continue;
+        }
+
+        size_t len = (size_t)st.st_size < share ? (size_t)st.st_size : share;
+        size_t done;
+        for (done = 0; done < len; done += WARMUP_CHUNK)
+        {
+            // Checked between pieces, so a cancel waits on at most one
+            if (!warmupcheck(warmup, gen))
+                break;
+
+            size_t chunk = len - done;
+            readahead(fd, done, chunk < WARMUP_CHUNK ? chunk : WARMUP_CHUNK);
+        }
+
+        close(fd);
+
+        left -= done < len ? done : len;
+    }
+}
+
+static void *warmupthread(void *arg)
+{
+    struct Warmup *warmup = (struct Warmup *)arg;
+
+    // Reads for anything else go first on schedulers that support it
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+    pthread_mutex_lock(&warmup->lock);
+
+    while (1)
+    {
+        while (!warmup->path && !warmup->stopping)
+            pthread_cond_wait(&warmup->cond, &warmup->lock);
+
+        if (warmup->stopping)
+            break;
+
+        unsigned int gen = warmup->gen;
+        char *path = warmup->path;
+        char **names = warmup->names;
+        int count = warmup->count;
+
+        warmup->path = NULL;
+        warmup->names = NULL;
+        warmup->count = 0;
+
+        // Give the core a moment to load before competing with it
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += WARMUP_DELAY;
+
+        while (warmuplive(warmup, gen))
+        {
+            if (pthread_cond_timedwait(&warmup->cond, &warmup->lock, &until) == ETIMEDOUT)
+                break;
+        }
+
+        if (warmuplive(warmup, gen))
+        {
+            pthread_mutex_unlock(&warmup->lock);
+            warmuprun(warmup, gen, path, names, count);
+            pthread_mutex_lock(&warmup->lock);
+        }
+
+        warmupfree(path, names, count);
+    }
+
+    pthread_mutex_unlock(&warmup->lock);
+
+    return NULL;
+}
+
+int warmupopen(struct Warmup *warmup, size_t budget)
+{
+    memset(warmup, 0, sizeof(struct Warmup));
+    warmup->budget = budget;
+
+    if (pthread_mutex_init(&warmup->lock, NULL))
+    {
+        printf("Failed to create warmup lock\n");
+        return -1;
+    }
+
+    if (pthread_cond_init(&warmup->cond, NULL))
+    {
+        printf("Failed to create warmup condition\n");
+        pthread_mutex_destroy(&warmup->lock);
+        return -1;
+    }
+
+    if (pthread_create(&warmup->thread, NULL, warmupthread, warmup))
+    {
+        printf("Failed to start warmup thread\n");
+        pthread_cond_destroy(&warmup->cond);
+        pthread_mutex_destroy(&warmup->lock);
+        return -1;
+    }
+
+    warmup->started = 1;
+
+    return 0;
+}
+
+void warmupclose(struct Warmup *warmup)
+{
+    if (!warmup->started)
+        return;
+
+    pthread_mutex_lock(&warmup->lock);
+    warmup->stopping = 1;
+    pthread_cond_broadcast(&warmup->cond);
+    pthread_mutex_unlock(&warmup->lock);
+
+    pthread_join(warmup->thread, NULL);
+    warmup->started = 0;
+
+    warmupfree(warmup->path, warmup->names, warmup->count);
+    warmupdisown(warmup);
+
+    pthread_cond_destroy(&warmup->cond);
+    pthread_mutex_destroy(&warmup->lock);
+}
+
+int warmupstart(struct Warmup *warmup, const char *path, char **names, int count)
+{
+    if (!warmup->started)
+        return -1;
+
+    char *pathcopy;
+    char **namescopy;
+    if ((pathcopy = strdup(path)) == NULL)
+        return -1;
+
+    if ((namescopy = calloc(count ? count : 1, sizeof(char *))) == NULL)
+    {
+        free(pathcopy);
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        if ((namescopy[i] = strdup(names[i])) == NULL)
+        {
+            warmupfree(pathcopy, namescopy, i);
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&warmup->lock);
+
+    // Replaces whatever was pending or running for the last core
+    warmupfree(warmup->path, warmup->names, warmup->count);
+    warmupdisown(warmup);
+
+    warmup->gen++;
+    warmup->owner = warmup->gen;
+    warmup->path = pathcopy;
+    warmup->names = namescopy;
+    warmup->count = count;
+    pthread_cond_broadcast(&warmup->cond);
+
+    pthread_mutex_unlock(&warmup->lock);
+
+    return 0;
+}
+
+void warmupcancel(struct Warmup *warmup)
+{
+    if (!warmup->started)
+        return;
+
+    pthread_mutex_lock(&warmup->lock);
+
+    warmupfree(warmup->path, warmup->names, warmup->count);
+    warmup->path = NULL;
+    warmup->names = NULL;
+    warmup->count = 0;
+
+    warmup->gen++;
+    pthread_cond_broadcast(&warmup->cond);
+
+    pthread_mutex_unlock(&warmup->lock);
+}
+
+int warmupowned(struct Warmup *warmup, const char *name)
+{
+    if (!warmup->started)
+        return 0;
+
+    return warmupdrop(warmup, name);
+}
\ No newline at end of file
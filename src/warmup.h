@@ -0,0 +1,44 @@
+#include <pthread.h>
+#include <sys/types.h>
+
+// ROMs warmed after a core switch, most recent first, then favorites
+#define WARMUP_RECENTS 5
+#define WARMUP_ROMS 10
+
+// Default page cache budget in megabytes, shared by all warmed ROMs
+#define WARMUP_BUDGET 64
+
+// Seconds to leave the core to load before warming starts
+#define WARMUP_DELAY 2
+
+// Largest range a single readahead is sure to cover
+#define WARMUP_CHUNK (128 * 1024)
+
+// A ROM opened by the warmup, so its open event isn't taken for the user's
+struct WarmupOwned
+{
+    struct WarmupOwned *next;
+    char name[];
+};
+
+struct Warmup
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t budget;
+    unsigned int gen;
+    unsigned int owner;
+    char *path;
+    char **names;
+    int count;
+    struct WarmupOwned *owned;
+    int stopping;
+    pthread_t thread;
+    int started;
+};
+
+int warmupopen(struct Warmup *warmup, size_t budget);
+void warmupclose(struct Warmup *warmup);
+int warmupstart(struct Warmup *warmup, const char *path, char **names, int count);
+void warmupcancel(struct Warmup *warmup);
+int warmupowned(struct Warmup *warmup, const char *name);
\ No newline at end of file